@@ -2,21 +2,37 @@
 #include "icallpath.h"
 #include "imap.h"
 
+// shared by every node of a tree, kept up to date as nodes are added
+struct icallpath_stats {
+    size_t nodes;
+    size_t memsize;
+    size_t rehash;
+};
+
 struct icallpath_context {
     uint64_t key;
     void* value;
     struct imap_context* children;
+    struct icallpath_stats* stats;
 };
 
-struct icallpath_context* icallpath_create(uint64_t key, void* value) {
+static struct icallpath_context* _icallpath_create(uint64_t key, void* value, struct icallpath_stats* stats) {
     struct icallpath_context* icallpath = (struct icallpath_context*)pmalloc(sizeof(*icallpath));
     icallpath->key = key;
     icallpath->value = value;
     icallpath->children = imap_create();
+    icallpath->stats = stats;
+    stats->nodes++;
+    stats->memsize += sizeof(*icallpath) + imap_memsize(icallpath->children);
 
     return icallpath;
 }
 
+struct icallpath_context* icallpath_create(uint64_t key, void* value) {
+    struct icallpath_stats* stats = (struct icallpath_stats*)pcalloc(1, sizeof(*stats));
+    return _icallpath_create(key, value, stats);
+}
+
 void icallpath_free_child(uint64_t key, void* value, void* ud) {
     icallpath_free((struct icallpath_context*)value);
 }
@@ -26,6 +42,12 @@ void icallpath_free(struct icallpath_context* icallpath) {
         icallpath->value = NULL;
     }
     imap_dump(icallpath->children, icallpath_free_child, NULL);
+    struct icallpath_stats* stats = icallpath->stats;
+    stats->nodes--;
+    stats->memsize -= sizeof(*icallpath) + imap_memsize(icallpath->children);
+    if (stats->nodes == 0) {
+        pfree(stats);
+    }
     imap_free(icallpath->children);
     pfree(icallpath);
 }
@@ -36,8 +58,13 @@ struct icallpath_context* icallpath_get_child(struct icallpath_context* icallpat
 }
 
 struct icallpath_context* icallpath_add_child(struct icallpath_context* icallpath, uint64_t key, void* value) {
-    struct icallpath_context* child_path = icallpath_create(key, value);
+    struct icallpath_stats* stats = icallpath->stats;
+    struct icallpath_context* child_path = _icallpath_create(key, value, stats);
+    size_t memsize = imap_memsize(icallpath->children);
+    size_t rehash = imap_rehash_count(icallpath->children);
     imap_set(icallpath->children, key, child_path);
+    stats->memsize += imap_memsize(icallpath->children) - memsize;
+    stats->rehash += imap_rehash_count(icallpath->children) - rehash;
     return child_path;
 }
 
@@ -51,4 +78,16 @@ void icallpath_dump_children(struct icallpath_context* icallpath, observer obser
 
 size_t icallpath_children_size(struct icallpath_context* icallpath) {
     return imap_size(icallpath->children);
+}
+
+size_t icallpath_tree_size(struct icallpath_context* icallpath) {
+    return icallpath->stats->nodes;
+}
+
+size_t icallpath_tree_memsize(struct icallpath_context* icallpath) {
+    return icallpath->stats->memsize;
+}
+
+size_t icallpath_tree_rehash_count(struct icallpath_context* icallpath) {
+    return icallpath->stats->rehash;
 }
\ No newline at end of file
@@ -16,6 +16,10 @@ void* icallpath_getvalue(struct icallpath_context* icallpath);
 typedef void(*observer)(uint64_t key, void* value, void* ud);
 void icallpath_dump_children(struct icallpath_context* icallpath, observer observer_cb, void* ud);
 size_t icallpath_children_size(struct icallpath_context* icallpath);
+// nodes, bytes and children map rehash count of the whole tree the node belongs to
+size_t icallpath_tree_size(struct icallpath_context* icallpath);
+size_t icallpath_tree_memsize(struct icallpath_context* icallpath);
+size_t icallpath_tree_rehash_count(struct icallpath_context* icallpath);
 
 
 #endif
@@ -18,6 +18,7 @@ struct imap_context {
     struct imap_slot* slots;
     size_t size;
     size_t count;
+    size_t rehash;
     struct imap_slot* lastfree;
 };
 
@@ -29,6 +30,7 @@ imap_create() {
     imap->slots = (struct imap_slot*)pcalloc(DEFAULT_IMAP_SLOT_SIZE, sizeof(struct imap_slot));
     imap->size = DEFAULT_IMAP_SLOT_SIZE;
     imap->count = 0;
+    imap->rehash = 0;
     imap->lastfree = imap->slots + imap->size;
     return imap;
 }
@@ -63,6 +65,7 @@ _imap_rehash(struct imap_context* imap) {
     imap->size = new_sz;
     imap->slots = new_slots;
     imap->count = 0;
+    imap->rehash++;
 
     size_t i=0;
     for(i=0; i<old_size; i++) {
@@ -185,4 +188,14 @@ imap_dump(struct imap_context* imap, observer observer_cb, void* ud) {
 size_t
 imap_size(struct imap_context* imap) {
     return imap->count;
+}
+
+size_t
+imap_memsize(struct imap_context* imap) {
+    return sizeof(*imap) + imap->size * sizeof(struct imap_slot);
+}
+
+size_t
+imap_rehash_count(struct imap_context* imap) {
+    return imap->rehash;
 }
\ No newline at end of file
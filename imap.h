@@ -20,5 +20,7 @@ typedef void(*observer)(uint64_t key, void* value, void* ud);
 void imap_dump(struct imap_context* imap, observer observer_cb, void* ud);
 
 size_t imap_size(struct imap_context* imap);
+size_t imap_memsize(struct imap_context* imap);
+size_t imap_rehash_count(struct imap_context* imap);
 
 #endif
@@ -1,6 +1,10 @@
 #include "profile.h"
 #include "imap.h"
 #include "icallpath.h"
+#include "pshm.h"
+#include "psnap.h"
+#include <errno.h>
+#include <limits.h>
 #include "lobject.h"
 #include "lstate.h"
 #include <pthread.h>
@@ -11,9 +15,29 @@
 #define MAX_CO_SIZE                 1024
 #define NANOSEC                     1000000000
 #define MICROSEC                    1000000
+#define DEFAULT_SHM_NODES           65536
+#define DEFAULT_SHM_STRINGS         (4*1024*1024)
+#define DEFAULT_BUDGET_WINDOW       100         // millisecond
+#define GOVERNOR_COUNT              1000        // instructions between checks while throttled
+#define GOVERNOR_MAX_THROTTLE       10          // windows
+#define MIN_COVERAGE                0.0001
+#define GC_NODE_KEY                 1           // never a prototype address
+#define MAX_LINE_PATTERN            64
+#define DEFAULT_SLOW_RING           64
+#define DEFAULT_SERIES_PERIOD       1000        // millisecond
+#define DUMP_STEP_CHECK             64          // nodes between clock checks in dump_step
+
+// hook features, every combination gets its own specialized hook
+#define PF_ALLOC                    1           // allocation and gc counters
+#define PF_COROUTINE                2           // exclude the time spent in other coroutines
+#define PF_STATS                    4           // time the hook itself, needed by the budget and gc attribution
+#define PF_ALL                      (PF_ALLOC | PF_COROUTINE | PF_STATS)
+#define PF_DEFAULT                  (PF_ALLOC | PF_COROUTINE)
 
 #ifdef USE_RDTSC
     #include "rdtsc.h"
+    #define TICKS_PER_SEC           2000000000
+
     static inline uint64_t
     gettime() {
         return rdtsc();
@@ -21,9 +45,11 @@
 
     static inline double
     realtime(uint64_t t) {
-        return (double) t / (2000000000);
+        return (double) t / (TICKS_PER_SEC);
     }
 #else
+    #define TICKS_PER_SEC           NANOSEC
+
     static inline uint64_t
     gettime() {
         struct timespec ti;
@@ -45,6 +71,7 @@
 
 
 struct callpath_node;
+struct line_profile;
 struct call_frame {
     const void* point;
     const void* prototype;
@@ -58,11 +85,35 @@ struct call_frame {
     uint64_t alloc_start;
 };
 
+// the state of the optional features lives in side arrays indexed like call_list,
+// they are only allocated once the feature is used by the coroutine
+struct frame_gc {
+    uint64_t gc_co_cost;
+    uint64_t gc_start;
+};
+
+struct frame_line {
+    struct line_profile* lines;
+    int      line_cur;
+    uint64_t line_start;
+};
+
+struct frame_slow {
+    uint64_t child_cost;
+    uint64_t max_child_cost;
+    struct callpath_node* max_child;
+};
+
 struct call_state {
     lua_State*  co;
     uint64_t    leave_time;
     uint64_t    leave_alloc;
+    uint64_t    leave_gc;
+    bool        line_hook;
     int         top;
+    struct frame_gc*    gc_list;
+    struct frame_line*  line_list;
+    struct frame_slow*  slow_list;
     struct call_frame   call_list[0];
 };
 
@@ -75,6 +126,85 @@ struct profile_context {
     struct imap_context*        cs_map;
     struct icallpath_context*   callpath;
     struct call_state*          cur_cs;
+    struct pshm_context*        shm;
+    int         features;
+    lua_Hook    hook;
+
+    // self instrumentation
+    uint64_t    hook_events;
+    uint64_t    hook_time;
+    uint64_t    hook_max;
+    size_t      line_bytes;
+
+    // overhead governor, budget is the max ratio of hook time to wall time
+    double      budget;
+    uint64_t    budget_window;
+    uint64_t    window_start;
+    uint64_t    window_hook_time;
+    bool        throttled;
+    uint64_t    throttle_start;
+    uint64_t    throttle_end;
+    uint64_t    uncovered_time;
+
+    // gc attribution
+    bool        track_gc;
+    bool        in_gc;
+    global_State*   gstate;
+    uint64_t    last_alloc_time;
+    lu_byte     gc_state;       // gcstate and expected GCdebt after the last allocator call
+    l_mem       gc_debt;
+    uint64_t    gc_time;
+
+    // line level profiling of the selected prototypes
+    int         line_pattern_count;
+    char*       line_patterns[MAX_LINE_PATTERN];
+    struct imap_context*    line_protos;    // Proto* -> line_profile
+    struct imap_context*    line_skip;      // Proto* not selected
+
+    // slow call records, preallocated ring written from the hook
+    uint64_t    slow_threshold;
+    struct slow_record*     slow_ring;
+    size_t      slow_cap;
+    size_t      slow_head;
+    size_t      slow_count;
+    uint64_t    slow_dropped;
+
+    // ring of the last series_size windows per node, rotated by epoch
+    int         series_size;
+    uint64_t    series_period;
+    uint64_t    series_epoch;
+    uint64_t    series_epoch_end;
+
+    // resumable dump, counters are copied on write while a snapshot is active
+    bool        snap_active;
+    uint32_t    snap_epoch;
+    struct dump_cursor*     cursor;
+};
+
+struct series_slot {
+    uint64_t count;
+    uint64_t record_time;
+    uint64_t alloc_count;
+};
+
+// the stack of a slow call is the parent chain of its node in the call tree
+struct slow_record {
+    struct callpath_node*   node;
+    struct callpath_node*   max_child;
+    uint64_t    ret_time;
+    uint64_t    inclusive;
+    uint64_t    exclusive;
+    uint64_t    max_child_cost;
+    uint64_t    alloc_count;
+};
+
+// per line hits and exclusive time of one prototype, indexed by line - linedefined
+struct line_profile {
+    const char* source;
+    int         linedefined;
+    int         size;
+    uint64_t*   hits;
+    uint64_t*   time;
 };
 
 struct callpath_node {
@@ -88,6 +218,16 @@ struct callpath_node {
     uint64_t count;
     uint64_t record_time;
     uint64_t alloc_count;
+    uint64_t gc_time;
+    uint32_t shm_index;
+    uint64_t series_epoch;
+    struct series_slot* series;
+    uint32_t born_epoch;
+    uint32_t snap_epoch;
+    uint64_t snap_count;
+    uint64_t snap_record_time;
+    uint64_t snap_alloc_count;
+    uint64_t snap_gc_time;
 };
 
 static struct callpath_node*
@@ -103,6 +243,16 @@ callpath_node_create() {
     node->count = 0;
     node->record_time = 0;
     node->alloc_count = 0;
+    node->gc_time = 0;
+    node->shm_index = PSHM_NONE;
+    node->series_epoch = 0;
+    node->series = NULL;
+    node->born_epoch = 0;
+    node->snap_epoch = 0;
+    node->snap_count = 0;
+    node->snap_record_time = 0;
+    node->snap_alloc_count = 0;
+    node->snap_gc_time = 0;
     return node;
 }
 
@@ -118,19 +268,101 @@ profile_create() {
     context->alloc_count = 0;
     context->last_alloc_f = NULL;
     context->last_alloc_ud = NULL;
+    context->shm = NULL;
+    context->features = PF_DEFAULT;
+    context->hook = NULL;
+    context->hook_events = 0;
+    context->hook_time = 0;
+    context->hook_max = 0;
+    context->line_bytes = 0;
+    context->budget = 0;
+    context->budget_window = 0;
+    context->window_start = 0;
+    context->window_hook_time = 0;
+    context->throttled = false;
+    context->throttle_start = 0;
+    context->throttle_end = 0;
+    context->uncovered_time = 0;
+    context->track_gc = false;
+    context->in_gc = false;
+    context->gstate = NULL;
+    context->last_alloc_time = 0;
+    context->gc_state = 0;
+    context->gc_debt = 0;
+    context->gc_time = 0;
+    context->line_pattern_count = 0;
+    context->line_protos = NULL;
+    context->line_skip = NULL;
+    context->slow_threshold = 0;
+    context->slow_ring = NULL;
+    context->slow_cap = 0;
+    context->slow_head = 0;
+    context->slow_count = 0;
+    context->slow_dropped = 0;
+    context->series_size = 0;
+    context->series_period = 0;
+    context->series_epoch = 0;
+    context->series_epoch_end = 0;
+    context->snap_active = false;
+    context->snap_epoch = 0;
+    context->cursor = NULL;
     return context;
 }
 
 static void
 _ob_free_call_state(uint64_t key, void* value, void* ud) {
-    pfree(value);
+    struct call_state* cs = (struct call_state*)value;
+    pfree(cs->gc_list);
+    pfree(cs->line_list);
+    pfree(cs->slow_list);
+    pfree(cs);
+}
+static void
+_ob_free_line_profile(uint64_t key, void* value, void* ud) {
+    struct line_profile* lp = (struct line_profile*)value;
+    pfree(lp->hits);
+    pfree(lp->time);
+    pfree(lp);
+}
+static void
+_ob_free_series(uint64_t key, void* value, void* ud) {
+    struct icallpath_context* path = (struct icallpath_context*)value;
+    struct callpath_node* node = (struct callpath_node*)icallpath_getvalue(path);
+    pfree(node->series);
+    node->series = NULL;
+    icallpath_dump_children(path, _ob_free_series, ud);
 }
 static void
 profile_free(struct profile_context* context) {
+    if (context->callpath && context->series_size > 0) {
+        _ob_free_series(0, context->callpath, NULL);
+    }
+    if (context->line_protos) {
+        imap_dump(context->line_protos, _ob_free_line_profile, NULL);
+        imap_free(context->line_protos);
+        context->line_protos = NULL;
+    }
+    if (context->line_skip) {
+        imap_free(context->line_skip);
+        context->line_skip = NULL;
+    }
+    int i = 0;
+    for (i = 0; i < context->line_pattern_count; i++) {
+        pfree(context->line_patterns[i]);
+    }
+    if (context->slow_ring) {
+        pfree(context->slow_ring);
+        context->slow_ring = NULL;
+    }
+
     if (context->callpath) {
         icallpath_free(context->callpath);
         context->callpath = NULL;
     }
+    if (context->shm) {
+        pshm_free(context->shm);
+        context->shm = NULL;
+    }
 
     imap_dump(context->cs_map, _ob_free_call_state, NULL);
     imap_free(context->cs_map);
@@ -164,6 +396,11 @@ cur_callframe(struct call_state* cs) {
     return &cs->call_list[idx];
 }
 
+static inline int
+callframe_index(struct call_state* cs, struct call_frame* frame) {
+    return (int)(frame - cs->call_list);
+}
+
 struct snlua {
     struct profile_context * context;
 };
@@ -175,6 +412,23 @@ _get_profile(lua_State* L) {
     return ((struct snlua*)(ud))->context;
 }
 
+// keep the counters seen by an active snapshot before the first change
+static inline void
+snapshot_preserve(struct profile_context* context, struct callpath_node* node) {
+    if (context->snap_active && node->snap_epoch != context->snap_epoch) {
+        node->snap_epoch = context->snap_epoch;
+        node->snap_count = node->count;
+        node->snap_record_time = node->record_time;
+        node->snap_alloc_count = node->alloc_count;
+        node->snap_gc_time = node->gc_time;
+    }
+}
+
+static inline uint32_t
+snapshot_born_epoch(struct profile_context* context) {
+    return context->snap_active ? context->snap_epoch : 0;
+}
+
 static struct icallpath_context*
 get_frame_path(struct profile_context* context, lua_State* co, lua_Debug* far, struct icallpath_context* pre_callpath, struct call_frame* frame) {
     if (!context->callpath) {
@@ -182,6 +436,9 @@ get_frame_path(struct profile_context* context, lua_State* co, lua_Debug* far, s
         node->name = "total";
         node->source = node->name;
         context->callpath = icallpath_create(0, node);
+        if (context->shm) {
+            node->shm_index = pshm_add_node(context->shm, PSHM_NONE, node->name, node->source, node->line);
+        }
     }
     struct icallpath_context* path = pre_callpath;
     if (!path) {
@@ -198,6 +455,7 @@ get_frame_path(struct profile_context* context, lua_State* co, lua_Debug* far, s
         node->parent = path_parent;
         node->point = cur_cf->prototype;
         node->depth = path_parent->depth + 1;
+        node->born_epoch = snapshot_born_epoch(context);
         node->ret_time = 0;
         node->record_time = 0;
         node->count = 0;
@@ -240,11 +498,72 @@ get_frame_path(struct profile_context* context, lua_State* co, lua_Debug* far, s
         cur_node->name = name ? name : "null";
         cur_node->source = source ? source : "null";
         cur_node->line = line;
+        if (context->shm && cur_node->parent->shm_index != PSHM_NONE) {
+            cur_node->shm_index = pshm_add_node(context->shm, cur_node->parent->shm_index,
+                cur_node->name, cur_node->source, cur_node->line);
+        }
     }
     
     return path;
 }
 
+// charge collector time to a "[gc]" child of the running frame
+static void
+gc_charge(struct profile_context* context, uint64_t cost, bool new_step) {
+    context->gc_time += cost;
+
+    struct call_frame* frame = context->cur_cs ? cur_callframe(context->cur_cs) : NULL;
+    struct icallpath_context* path = frame ? frame->path : context->callpath;
+    if (!path) {
+        return;
+    }
+    struct icallpath_context* gc_path = icallpath_get_child(path, GC_NODE_KEY);
+    if (!gc_path) {
+        struct callpath_node* parent = (struct callpath_node*)icallpath_getvalue(path);
+        struct callpath_node* node = callpath_node_create();
+        node->parent = parent;
+        node->name = "[gc]";
+        node->source = parent->source;
+        node->line = parent->line;
+        node->depth = parent->depth + 1;
+        node->born_epoch = snapshot_born_epoch(context);
+        if (context->shm && parent->shm_index != PSHM_NONE) {
+            node->shm_index = pshm_add_node(context->shm, parent->shm_index, node->name, node->source, node->line);
+        }
+        gc_path = icallpath_add_child(path, GC_NODE_KEY, node);
+    }
+
+    struct callpath_node* node = (struct callpath_node*)icallpath_getvalue(gc_path);
+    snapshot_preserve(context, node);
+    node->record_time += cost;
+    node->gc_time += cost;
+    if (new_step) {
+        node->count++;
+    }
+    if (node->shm_index != PSHM_NONE) {
+        struct pshm_node* shm_node = pshm_get_node(context->shm, node->shm_index);
+        pshm_write_begin(shm_node);
+        shm_node->count = node->count;
+        shm_node->record_time = node->record_time;
+        pshm_write_end(shm_node);
+    }
+}
+
+// a collector step ran since the last allocator call or hook when it is running now
+// (gcstopem is set while a step frees objects), when gcstate moved, or when GCdebt is not
+// what the allocations left, a step always resets it; the time since then is collector work
+static inline void
+gc_check(struct profile_context* context, uint64_t now) {
+    global_State* g = context->gstate;
+    bool in_step = g->gcstopem != 0;
+    if (in_step || g->gcstate != context->gc_state || g->GCdebt != context->gc_debt) {
+        gc_charge(context, now - context->last_alloc_time, !context->in_gc);
+        context->gc_state = g->gcstate;
+        context->gc_debt = g->GCdebt;
+    }
+    context->in_gc = in_step;
+}
+
 static void*
 _resolve_alloc(void *ud, void *ptr, size_t osize, size_t nsize) {
     struct profile_context* context = ((struct snlua*)ud)->context;
@@ -252,20 +571,346 @@ _resolve_alloc(void *ud, void *ptr, size_t osize, size_t nsize) {
     if (nsize > 0 && nsize > old && context->increment_alloc_count) {
         context->alloc_count += (nsize - old);
     }
+    if (!context->track_gc) {
+        return context->last_alloc_f(context->last_alloc_ud, ptr, osize, nsize);
+    }
 
+    // the allocations of the hook and of the dumps are never charged
+    uint64_t now = gettime();
+    if (context->increment_alloc_count) {
+        gc_check(context, now);
+    }
+    context->last_alloc_time = now;
     void* p = context->last_alloc_f(context->last_alloc_ud, ptr, osize, nsize);
+    // lua adds the size change to GCdebt after the allocator returns, a failed allocation changes nothing
+    l_mem delta = (p == NULL && nsize > 0) ? 0 : (l_mem)nsize - (l_mem)old;
+    context->gc_state = context->gstate->gcstate;
+    context->gc_debt = context->gstate->GCdebt + delta;
     return p;
 }
 
+static struct line_profile *
+line_profile_create(struct profile_context* context, const Proto* p) {
+    struct line_profile* lp = (struct line_profile*)pmalloc(sizeof(*lp));
+    lp->source = p->source ? getstr(p->source) : "?";
+    lp->linedefined = p->linedefined;
+    lp->size = 0;
+    lp->hits = NULL;
+    lp->time = NULL;
+    imap_set(context->line_protos, (uint64_t)((uintptr_t)p), lp);
+    context->line_bytes += sizeof(*lp);
+    return lp;
+}
+
+static struct line_profile *
+line_profile_get(struct profile_context* context, const Proto* p) {
+    uint64_t key = (uint64_t)((uintptr_t)p);
+    struct line_profile* lp = (struct line_profile*)imap_query(context->line_protos, key);
+    if (lp || imap_query(context->line_skip, key)) {
+        return lp;
+    }
+
+    const char* source = p->source ? getstr(p->source) : NULL;
+    int i = 0;
+    for (i = 0; source && i < context->line_pattern_count; i++) {
+        if (strstr(source, context->line_patterns[i])) {
+            return line_profile_create(context, p);
+        }
+    }
+    imap_set(context->line_skip, key, (void*)p);
+    return NULL;
+}
+
 static void
-_resolve_hook(lua_State* L, lua_Debug* far) {
+line_profile_hit(struct profile_context* context, struct line_profile* lp, int line) {
+    int idx = line - lp->linedefined;
+    if (idx < 0) {
+        return;
+    }
+    if (idx >= lp->size) {
+        int size = lp->size > 0 ? lp->size : 16;
+        while (size <= idx) {
+            size *= 2;
+        }
+        lp->hits = (uint64_t*)prealloc(lp->hits, sizeof(uint64_t) * size);
+        lp->time = (uint64_t*)prealloc(lp->time, sizeof(uint64_t) * size);
+        memset(lp->hits + lp->size, 0, sizeof(uint64_t) * (size - lp->size));
+        memset(lp->time + lp->size, 0, sizeof(uint64_t) * (size - lp->size));
+        context->line_bytes += sizeof(uint64_t) * 2 * (size - lp->size);
+        lp->size = size;
+    }
+    lp->hits[idx]++;
+}
+
+// close the running line of the frame, its time is exclusive of the calls it makes
+static inline void
+line_profile_pause(struct call_state* cs, struct call_frame* frame, uint64_t cur_time) {
+    if (frame && cs->line_list) {
+        struct frame_line* fl = &cs->line_list[callframe_index(cs, frame)];
+        if (fl->lines && fl->line_cur >= 0) {
+            int idx = fl->line_cur - fl->lines->linedefined;
+            if (idx >= 0 && idx < fl->lines->size) {
+                fl->lines->time[idx] += cur_time - fl->line_start;
+            }
+        }
+    }
+}
+
+static inline struct frame_line*
+cur_frame_line(struct call_state* cs) {
+    struct call_frame* frame = cur_callframe(cs);
+    if (frame && cs->line_list) {
+        struct frame_line* fl = &cs->line_list[callframe_index(cs, frame)];
+        return fl->lines ? fl : NULL;
+    }
+    return NULL;
+}
+
+// LUA_MASKLINE is only set while a selected prototype is the active frame
+static inline void
+line_hook_update(struct profile_context* context, lua_State* L, struct call_state* cs) {
+    bool line_hook = cur_frame_line(cs) != NULL;
+    if (line_hook != cs->line_hook) {
+        cs->line_hook = line_hook;
+        lua_sethook(L, context->hook, LUA_MASKCALL | LUA_MASKRET | (line_hook ? LUA_MASKLINE : 0), 0);
+    }
+}
+
+static struct call_frame *
+push_frame_path(struct profile_context* context, lua_State* L, lua_Debug* far, struct call_state* cs, bool tail, uint64_t cur_time) {
+    const void* point = NULL;
+    if (far->i_ci && far->i_ci->func.p) {
+        point = far->i_ci->func.p;
+    } else {
+        lua_getinfo(L, "f", far);
+        point = lua_topointer(L, -1);
+    }
+
+    struct icallpath_context* pre_callpath = NULL;
+    struct call_frame* pre_frame = cur_callframe(cs);
+    if (pre_frame) {
+        pre_callpath = pre_frame->path;
+    }
+
+    struct call_frame* frame = push_callframe(cs);
+    frame->point = point;
+    frame->tail = tail;
+    frame->sub_cost = 0;
+    frame->call_time = cur_time;
+    frame->alloc_co_cost = 0;
+    frame->alloc_start = context->alloc_count;
+    frame->prototype = point;
+    if (far->i_ci && ttisclosure(s2v(far->i_ci->func.p))) {
+        Closure *cl = clvalue(s2v(far->i_ci->func.p));
+        if (cl && cl->c.tt == LUA_VLCL) {
+            frame->prototype = cl->l.p;
+        }
+    }
+
+    int idx = callframe_index(cs, frame);
+    if (cs->gc_list) {
+        cs->gc_list[idx].gc_co_cost = 0;
+        cs->gc_list[idx].gc_start = context->gc_time;
+    }
+    struct line_profile* lines = NULL;
+    if (context->line_protos && frame->prototype != frame->point) {
+        lines = line_profile_get(context, (const Proto*)frame->prototype);
+        if (lines && !cs->line_list) {
+            cs->line_list = (struct frame_line*)pcalloc(MAX_CALL_SIZE, sizeof(struct frame_line));
+        }
+    }
+    if (cs->line_list) {
+        cs->line_list[idx].lines = lines;
+        cs->line_list[idx].line_cur = -1;
+        cs->line_list[idx].line_start = cur_time;
+    }
+    if (context->slow_threshold > 0 && !cs->slow_list) {
+        cs->slow_list = (struct frame_slow*)pcalloc(MAX_CALL_SIZE, sizeof(struct frame_slow));
+    }
+    if (cs->slow_list) {
+        cs->slow_list[idx].child_cost = 0;
+        cs->slow_list[idx].max_child_cost = 0;
+        cs->slow_list[idx].max_child = NULL;
+    }
+    frame->path = get_frame_path(context, L, far, pre_callpath, frame);
+    return frame;
+}
+
+// rebuild the shadow stack of a coroutine from its lua stack, used when the call hook is set again
+static void
+rebuild_callframes(struct profile_context* context, lua_State* L, struct call_state* cs, uint64_t cur_time) {
+    lua_Debug ar;
+    int level = 0;
+    while (lua_getstack(L, level, &ar)) {
+        level++;
+    }
+    if (level > MAX_CALL_SIZE) {
+        level = MAX_CALL_SIZE;
+    }
+
+    // the caller of a frame entered by a tail call is not on the lua stack any more,
+    // no frame is marked tail so a return never pops a caller that is still running
+    cs->top = 0;
+    for (level = level - 1; level >= 0; level--) {
+        lua_getstack(L, level, &ar);
+        push_frame_path(context, L, &ar, cs, false, cur_time);
+    }
+}
+
+static void
+slow_record_push(struct profile_context* context, struct call_frame* frame, struct frame_slow* slow, uint64_t alloc_count) {
+    struct slow_record* r = &context->slow_ring[context->slow_head];
+    context->slow_head = (context->slow_head + 1) % context->slow_cap;
+    if (context->slow_count < context->slow_cap) {
+        context->slow_count++;
+    } else {
+        context->slow_dropped++;
+    }
+    r->node = (struct callpath_node*)icallpath_getvalue(frame->path);
+    r->max_child = slow->max_child;
+    r->ret_time = frame->ret_time;
+    r->inclusive = frame->real_cost;
+    r->exclusive = frame->real_cost > slow->child_cost ? frame->real_cost - slow->child_cost : 0;
+    r->max_child_cost = slow->max_child_cost;
+    r->alloc_count = alloc_count;
+}
+
+static inline uint64_t
+series_advance(struct profile_context* context, uint64_t cur_time) {
+    if (cur_time >= context->series_epoch_end) {
+        uint64_t n = (cur_time - context->series_epoch_end) / context->series_period + 1;
+        context->series_epoch += n;
+        context->series_epoch_end += n * context->series_period;
+    }
+    return context->series_epoch;
+}
+
+static void
+series_update(struct profile_context* context, struct callpath_node* node, uint64_t cur_time, uint64_t cost, uint64_t alloc_count) {
+    uint64_t epoch = series_advance(context, cur_time);
+    uint64_t size = (uint64_t)context->series_size;
+    if (!node->series) {
+        node->series = (struct series_slot*)pcalloc(size, sizeof(struct series_slot));
+        node->series_epoch = epoch;
+    } else if (node->series_epoch != epoch) {
+        // clear the windows skipped since the last update of this node
+        uint64_t gap = epoch - node->series_epoch;
+        uint64_t i = 0;
+        for (i = 1; i <= gap && i <= size; i++) {
+            memset(&node->series[(node->series_epoch + i) % size], 0, sizeof(struct series_slot));
+        }
+        node->series_epoch = epoch;
+    }
+    struct series_slot* slot = &node->series[epoch % size];
+    slot->count++;
+    slot->record_time += cost;
+    slot->alloc_count += alloc_count;
+}
+
+// the frames dropped by the governor keep the time they ran before the throttle,
+// their count is added when they return after the stack is rebuilt
+static void
+flush_callframes(struct profile_context* context, struct call_state* cs, uint64_t cur_time) {
+    int i = 0;
+    for (i = cs->top - 1; i >= 0; i--) {
+        struct call_frame* frame = &cs->call_list[i];
+        struct callpath_node* node = (struct callpath_node*)icallpath_getvalue(frame->path);
+        uint64_t total_cost = cur_time - frame->call_time;
+        line_profile_pause(cs, frame, cur_time);
+
+        snapshot_preserve(context, node);
+        node->record_time += total_cost > frame->sub_cost ? total_cost - frame->sub_cost : 0;
+        node->alloc_count += context->alloc_count - frame->alloc_start - frame->alloc_co_cost;
+        if (cs->gc_list) {
+            node->gc_time += context->gc_time - cs->gc_list[i].gc_start - cs->gc_list[i].gc_co_cost;
+        }
+        if (node->shm_index != PSHM_NONE) {
+            struct pshm_node* shm_node = pshm_get_node(context->shm, node->shm_index);
+            pshm_write_begin(shm_node);
+            shm_node->record_time = node->record_time;
+            shm_node->alloc_count = node->alloc_count;
+            pshm_write_end(shm_node);
+        }
+    }
+}
+
+// return false when the event must not be recorded
+static bool
+governor_check(struct profile_context* context, lua_State* L, struct call_state* cs, int event, uint64_t cur_time) {
+    if (context->throttled) {
+        if (cur_time >= context->throttle_end) {
+            context->throttled = false;
+            context->uncovered_time += cur_time - context->throttle_start;
+            context->window_start = cur_time;
+            context->window_hook_time = 0;
+        }
+    } else if (cur_time - context->window_start >= context->budget_window) {
+        uint64_t elapsed = cur_time - context->window_start;
+        double ratio = (double)context->window_hook_time / elapsed;
+        if (ratio > context->budget) {
+            // stay unhooked long enough to bring the average back to the budget
+            uint64_t off = (uint64_t)(context->window_hook_time / context->budget) - elapsed;
+            uint64_t max_off = context->budget_window * GOVERNOR_MAX_THROTTLE;
+            context->throttled = true;
+            context->throttle_start = cur_time;
+            context->throttle_end = cur_time + (off < max_off ? off : max_off);
+        } else {
+            context->window_start = cur_time;
+            context->window_hook_time = 0;
+        }
+    }
+
+    if (context->throttled) {
+        if (event != LUA_HOOKCOUNT) {
+            // the shadow stack is dropped, it is rebuilt when the coroutine is hooked again
+            flush_callframes(context, cs, cur_time);
+            cs->top = 0;
+            cs->line_hook = false;
+            lua_sethook(L, context->hook, LUA_MASKCOUNT, GOVERNOR_COUNT);
+        }
+        return false;
+    }
+    if (event == LUA_HOOKCOUNT) {
+        lua_sethook(L, context->hook, LUA_MASKCALL | LUA_MASKRET, 0);
+        rebuild_callframes(context, L, cs, cur_time);
+        line_hook_update(context, L, cs);
+        return false;
+    }
+    return true;
+}
+
+// the share of the wall time spent with the hooks set
+static double
+profile_coverage(struct profile_context* context, uint64_t now) {
+    uint64_t wall = now - context->start;
+    uint64_t uncovered = context->uncovered_time;
+    if (context->throttled) {
+        uncovered += now - context->throttle_start;
+    }
+    if (wall == 0 || uncovered == 0) {
+        return 1.0;
+    }
+    double coverage = uncovered < wall ? (double)(wall - uncovered) / wall : 0;
+    return coverage > MIN_COVERAGE ? coverage : MIN_COVERAGE;
+}
+
+// features is a constant in every variant below, the code of the disabled features is compiled out,
+// the options set at runtime (shm, budget, lines, windows, slow calls, dump snapshot) cost one branch each
+static inline __attribute__((always_inline)) void
+_resolve_hook_impl(lua_State* L, lua_Debug* far, const int features) {
     struct profile_context* context = _get_profile(L);
     if(context->start == 0) {
         return;
     }
 
     uint64_t cur_time = gettime();
-    context->increment_alloc_count = false;
+    if (features & PF_ALLOC) {
+        context->increment_alloc_count = false;
+        // a step that allocated nothing since the last allocator call ends before this event
+        if (context->track_gc) {
+            gc_check(context, cur_time);
+        }
+    }
     int event = far->event;
     struct call_state* cs = context->cur_cs;
     if (!context->cur_cs || context->cur_cs->co != L) {
@@ -277,98 +922,187 @@ _resolve_hook(lua_State* L, lua_Debug* far) {
             cs->top = 0;
             cs->leave_time = 0;
             cs->leave_alloc = 0;
+            cs->leave_gc = 0;
+            cs->line_hook = false;
+            cs->gc_list = NULL;
+            cs->line_list = NULL;
+            cs->slow_list = NULL;
+            if (context->track_gc) {
+                cs->gc_list = (struct frame_gc*)pcalloc(MAX_CALL_SIZE, sizeof(struct frame_gc));
+            }
             imap_set(context->cs_map, key, cs);
         }
 
-        if (context->cur_cs) {
+        if ((features & PF_COROUTINE) && context->cur_cs) {
             context->cur_cs->leave_time = cur_time;
             context->cur_cs->leave_alloc = context->alloc_count;
+            context->cur_cs->leave_gc = context->gc_time;
         }
         context->cur_cs = cs;
     }
-    if (cs->leave_time > 0) {
-        assert(cur_time >= cs->leave_time);
+    if ((features & PF_COROUTINE) && cs->leave_time > 0) {
+        passert(cur_time >= cs->leave_time);
         uint64_t co_cost = cur_time - cs->leave_time;
         uint64_t co_alloc = context->alloc_count - cs->leave_alloc;
+        uint64_t co_gc = context->gc_time - cs->leave_gc;
 
         int i = 0;
         for (; i < cs->top; i++) {
             cs->call_list[i].sub_cost += co_cost;
-            cs->call_list[i].alloc_co_cost += co_alloc;
+            if (features & PF_ALLOC) {
+                cs->call_list[i].alloc_co_cost += co_alloc;
+                if (cs->gc_list) {
+                    cs->gc_list[i].gc_co_cost += co_gc;
+                }
+            }
         }
         cs->leave_time = 0;
         cs->leave_alloc = 0;
+        cs->leave_gc = 0;
     }
-    assert(cs->co == L);
-
-    if (event == LUA_HOOKCALL || event == LUA_HOOKTAILCALL) {
-        const void* point = NULL;
-        if (far->i_ci && far->i_ci->func.p) {
-            point = far->i_ci->func.p;
-        } else {
-            lua_getinfo(L, "f", far);
-            point = lua_topointer(L, -1);
-        }
+    passert(cs->co == L);
 
-        struct icallpath_context* pre_callpath = NULL;
+    bool active = true;
+    if (context->budget > 0) {
+        active = governor_check(context, L, cs, event, cur_time);
+    }
+    if (!active) {
+        // throttled by the governor
+    } else if (event == LUA_HOOKCALL || event == LUA_HOOKTAILCALL) {
         struct call_frame* pre_frame = cur_callframe(cs);
-        if (pre_frame) {
-            pre_callpath = pre_frame->path;
-        }
-
-        struct call_frame* frame = push_callframe(cs);
-        frame->point = point;
-        frame->tail = event == LUA_HOOKTAILCALL;
-        frame->sub_cost = 0;
-        frame->call_time = cur_time;
-        frame->alloc_co_cost = 0;
-        frame->alloc_start = context->alloc_count;
-        frame->prototype = point;
-        if (far->i_ci && ttisclosure(s2v(far->i_ci->func.p))) {
-            Closure *cl = clvalue(s2v(far->i_ci->func.p));
-            if (cl && cl->c.tt == LUA_VLCL) {
-                frame->prototype = cl->l.p;
-            }
+        line_profile_pause(cs, pre_frame, cur_time);
+        if (pre_frame && event == LUA_HOOKTAILCALL && cs->line_list) {
+            // the caller does not run again, its line is closed for good
+            cs->line_list[callframe_index(cs, pre_frame)].line_cur = -1;
+        }
+        push_frame_path(context, L, far, cs, event == LUA_HOOKTAILCALL, cur_time);
+        if (context->line_protos) {
+            line_hook_update(context, L, cs);
         }
-        frame->path = get_frame_path(context, L, far, pre_callpath, frame);
-    } else if (event == LUA_HOOKRET) {
-        int len = cs->top;
-        if (len <= 0) {
-            context->increment_alloc_count = true;
-            return;
+    } else if (event == LUA_HOOKLINE) {
+        struct frame_line* fl = cur_frame_line(cs);
+        if (fl) {
+            line_profile_pause(cs, cur_callframe(cs), cur_time);
+            line_profile_hit(context, fl->lines, far->currentline);
+            fl->line_cur = far->currentline;
+            fl->line_start = cur_time;
         }
+    } else if (event == LUA_HOOKRET && cs->top > 0) {
         bool tail_call = false;
         do {
             struct call_frame* cur_frame = pop_callframe(cs);
             struct callpath_node* cur_path = (struct callpath_node*)icallpath_getvalue(cur_frame->path);
             uint64_t total_cost = cur_time - cur_frame->call_time;
             uint64_t real_cost = total_cost - cur_frame->sub_cost;
-            uint64_t alloc_count = context->alloc_count - cur_frame->alloc_start - cur_frame->alloc_co_cost;
-            assert(context->alloc_count >= (cur_frame->alloc_start + cur_frame->alloc_co_cost));
-            assert(cur_time >= cur_frame->call_time && total_cost >= cur_frame->sub_cost);
+            passert(cur_time >= cur_frame->call_time && total_cost >= cur_frame->sub_cost);
             cur_frame->ret_time = cur_time;
             cur_frame->real_cost = real_cost;
+            line_profile_pause(cs, cur_frame, cur_time);
 
+            snapshot_preserve(context, cur_path);
             cur_path->ret_time = cur_path->ret_time == 0 ? cur_time : cur_path->ret_time;
             cur_path->record_time += real_cost;
             cur_path->count++;
-            cur_path->alloc_count += alloc_count;
+            uint64_t alloc_count = 0;
+            if (features & PF_ALLOC) {
+                passert(context->alloc_count >= (cur_frame->alloc_start + cur_frame->alloc_co_cost));
+                alloc_count = context->alloc_count - cur_frame->alloc_start - cur_frame->alloc_co_cost;
+                cur_path->alloc_count += alloc_count;
+                if (cs->gc_list) {
+                    struct frame_gc* gc = &cs->gc_list[callframe_index(cs, cur_frame)];
+                    cur_path->gc_time += context->gc_time - gc->gc_start - gc->gc_co_cost;
+                }
+            }
+            if (cur_path->shm_index != PSHM_NONE) {
+                struct pshm_node* shm_node = pshm_get_node(context->shm, cur_path->shm_index);
+                pshm_write_begin(shm_node);
+                shm_node->count = cur_path->count;
+                shm_node->record_time = cur_path->record_time;
+                shm_node->alloc_count = cur_path->alloc_count;
+                pshm_write_end(shm_node);
+            }
 
             struct call_frame* pre_frame = cur_callframe(cs);
+            if (pre_frame && cs->slow_list) {
+                struct frame_slow* pre_slow = &cs->slow_list[callframe_index(cs, pre_frame)];
+                pre_slow->child_cost += real_cost;
+                if (real_cost > pre_slow->max_child_cost) {
+                    pre_slow->max_child_cost = real_cost;
+                    pre_slow->max_child = cur_path;
+                }
+            }
+            if (context->series_size > 0) {
+                series_update(context, cur_path, cur_time, real_cost, alloc_count);
+            }
+            if (context->slow_threshold > 0 && real_cost >= context->slow_threshold && cs->slow_list) {
+                slow_record_push(context, cur_frame, &cs->slow_list[callframe_index(cs, cur_frame)], alloc_count);
+            }
             tail_call = pre_frame ? cur_frame->tail : false;
         }while(tail_call);
+        if (context->shm) {
+            pshm_set_now(context->shm, cur_time);
+        }
+        if (context->line_protos) {
+            struct frame_line* fl = cur_frame_line(cs);
+            if (fl) {
+                fl->line_start = cur_time;
+            }
+            line_hook_update(context, L, cs);
+        }
     }
 
-    context->increment_alloc_count = true;
+    if (features & PF_ALLOC) {
+        context->increment_alloc_count = true;
+    }
+
+    if (features & PF_STATS) {
+        // the hook itself is neither profiled code nor collector work
+        uint64_t end_time = gettime();
+        uint64_t hook_cost = end_time - cur_time;
+        context->hook_events++;
+        context->hook_time += hook_cost;
+        if (hook_cost > context->hook_max) {
+            context->hook_max = hook_cost;
+        }
+        context->window_hook_time += hook_cost;
+        if (features & PF_ALLOC) {
+            context->last_alloc_time = end_time;
+        }
+    }
 }
 
+#define PROFILE_HOOK(name, features) \
+    static void name(lua_State* L, lua_Debug* far) { _resolve_hook_impl(L, far, features); }
+
+PROFILE_HOOK(_resolve_hook_time, 0)
+PROFILE_HOOK(_resolve_hook_alloc, PF_ALLOC)
+PROFILE_HOOK(_resolve_hook_co, PF_COROUTINE)
+PROFILE_HOOK(_resolve_hook_alloc_co, PF_ALLOC | PF_COROUTINE)
+PROFILE_HOOK(_resolve_hook_stats, PF_STATS)
+PROFILE_HOOK(_resolve_hook_alloc_stats, PF_ALLOC | PF_STATS)
+PROFILE_HOOK(_resolve_hook_co_stats, PF_COROUTINE | PF_STATS)
+PROFILE_HOOK(_resolve_hook_all, PF_ALL)
+
+static const lua_Hook hook_variants[PF_ALL + 1] = {
+    _resolve_hook_time,
+    _resolve_hook_alloc,
+    _resolve_hook_co,
+    _resolve_hook_alloc_co,
+    _resolve_hook_stats,
+    _resolve_hook_alloc_stats,
+    _resolve_hook_co_stats,
+    _resolve_hook_all,
+};
+
 
 struct dump_call_path_arg {
     lua_State* L;
+    double scale;
     uint64_t record_time;
     uint64_t count;
     uint64_t index;
     uint64_t alloc_count;
+    uint64_t gc_time;
 };
 
 static void _dump_call_path(struct icallpath_context* path, struct dump_call_path_arg* arg);
@@ -383,10 +1117,12 @@ static void _dump_call_path(struct icallpath_context* path, struct dump_call_pat
 
     struct dump_call_path_arg child_arg;
     child_arg.L = arg->L;
+    child_arg.scale = arg->scale;
     child_arg.record_time = 0;
     child_arg.count = 0;
     child_arg.index = 0;
     child_arg.alloc_count = 0;
+    child_arg.gc_time = 0;
 
     if (icallpath_children_size(path) > 0) {
         lua_newtable(arg->L);
@@ -395,14 +1131,19 @@ static void _dump_call_path(struct icallpath_context* path, struct dump_call_pat
     }
 
     struct callpath_node* node = (struct callpath_node*)icallpath_getvalue(path);
-    uint64_t alloc_count = node->alloc_count > child_arg.alloc_count ? node->alloc_count : child_arg.alloc_count;
-    uint64_t count = node->count > child_arg.count ? node->count : child_arg.count;
-    uint64_t rt = realtime(node->record_time) * MICROSEC;
+    uint64_t node_alloc = node->alloc_count * arg->scale;
+    uint64_t node_count = node->count * arg->scale;
+    uint64_t alloc_count = node_alloc > child_arg.alloc_count ? node_alloc : child_arg.alloc_count;
+    uint64_t count = node_count > child_arg.count ? node_count : child_arg.count;
+    uint64_t rt = realtime(node->record_time) * MICROSEC * arg->scale;
     uint64_t record_time = rt > child_arg.record_time ? rt : child_arg.record_time;
+    uint64_t gt = realtime(node->gc_time) * MICROSEC * arg->scale;
+    uint64_t gc_time = gt > child_arg.gc_time ? gt : child_arg.gc_time;
 
     arg->record_time += record_time;
     arg->count += count;
     arg->alloc_count += alloc_count;
+    arg->gc_time += gc_time;
 
     char name[512] = {0};
     snprintf(name, sizeof(name)-1, "%s %s:%d", node->name ? node->name : "", node->source ? node->source : "", node->line);
@@ -420,18 +1161,553 @@ static void _dump_call_path(struct icallpath_context* path, struct dump_call_pat
 
     lua_pushinteger(arg->L, alloc_count);
     lua_setfield(arg->L, -2, "alloc_count");
+
+    lua_pushinteger(arg->L, gc_time);
+    lua_setfield(arg->L, -2, "gc_time");
 }
-static void dump_call_path(lua_State* L, struct icallpath_context* path) {
+static void dump_call_path(lua_State* L, struct icallpath_context* path, double scale) {
     struct dump_call_path_arg arg;
     arg.L = L;
+    arg.scale = scale;
     arg.record_time = 0;
     arg.count = 0;
     arg.index = 0;
     arg.alloc_count = 0;
+    arg.gc_time = 0;
     _dump_call_path(path, &arg);
 }
 
 
+// flattened call tree, breadth first so a parent always comes before its children
+#define FLAT_NONE   0xffffffff
+
+struct flat_node {
+    struct icallpath_context* path;
+    uint32_t parent;
+    uint64_t count;
+    uint64_t value;
+    uint64_t alloc_count;
+    uint64_t gc_time;
+};
+
+struct flat_tree {
+    struct flat_node* nodes;
+    size_t size;
+    size_t cap;
+};
+
+static void
+_flat_tree_push(struct flat_tree* tree, struct icallpath_context* path, uint32_t parent) {
+    if (tree->size >= tree->cap) {
+        tree->cap = tree->cap > 0 ? tree->cap * 2 : 1024;
+        tree->nodes = (struct flat_node*)prealloc(tree->nodes, sizeof(struct flat_node) * tree->cap);
+    }
+    struct flat_node* node = &tree->nodes[tree->size++];
+    node->path = path;
+    node->parent = parent;
+    node->count = 0;
+    node->value = 0;
+    node->alloc_count = 0;
+    node->gc_time = 0;
+}
+
+struct flat_tree_arg {
+    struct flat_tree* tree;
+    uint32_t parent;
+};
+
+static void
+_flat_tree_child(uint64_t key, void* value, void* ud) {
+    struct flat_tree_arg* arg = (struct flat_tree_arg*)ud;
+    _flat_tree_push(arg->tree, (struct icallpath_context*)value, arg->parent);
+}
+
+static void
+flat_tree_build(struct flat_tree* tree, struct icallpath_context* root) {
+    tree->nodes = NULL;
+    tree->size = 0;
+    tree->cap = 0;
+    _flat_tree_push(tree, root, FLAT_NONE);
+
+    size_t i = 0;
+    for (i = 0; i < tree->size; i++) {
+        struct flat_tree_arg arg;
+        arg.tree = tree;
+        arg.parent = (uint32_t)i;
+        icallpath_dump_children(tree->nodes[i].path, _flat_tree_child, &arg);
+    }
+}
+
+// same values as _dump_call_path: a node reports at least the sum of its children
+static void
+flat_tree_aggregate(struct flat_tree* tree, double scale) {
+    size_t i = tree->size;
+    while (i > 0) {
+        struct flat_node* flat = &tree->nodes[--i];
+        struct callpath_node* node = (struct callpath_node*)icallpath_getvalue(flat->path);
+        uint64_t rt = realtime(node->record_time) * MICROSEC * scale;
+        uint64_t count = node->count * scale;
+        uint64_t alloc_count = node->alloc_count * scale;
+        flat->count = count > flat->count ? count : flat->count;
+        flat->value = rt > flat->value ? rt : flat->value;
+        flat->alloc_count = alloc_count > flat->alloc_count ? alloc_count : flat->alloc_count;
+        uint64_t gt = realtime(node->gc_time) * MICROSEC * scale;
+        flat->gc_time = gt > flat->gc_time ? gt : flat->gc_time;
+        if (flat->parent != FLAT_NONE) {
+            struct flat_node* parent = &tree->nodes[flat->parent];
+            parent->count += flat->count;
+            parent->value += flat->value;
+            parent->alloc_count += flat->alloc_count;
+            parent->gc_time += flat->gc_time;
+        }
+    }
+}
+
+static void
+flat_tree_free(struct flat_tree* tree) {
+    pfree(tree->nodes);
+    tree->nodes = NULL;
+    tree->size = 0;
+    tree->cap = 0;
+}
+
+
+// deduplicated (name, source, line) of the call tree nodes
+struct symbol_table {
+    struct imap_context* map;           // hash -> index + 1
+    struct callpath_node** symbols;
+    size_t size;
+    size_t cap;
+};
+
+static void
+symbol_table_init(struct symbol_table* st) {
+    st->map = imap_create();
+    st->symbols = NULL;
+    st->size = 0;
+    st->cap = 0;
+}
+
+static void
+symbol_table_free(struct symbol_table* st) {
+    imap_free(st->map);
+    pfree(st->symbols);
+}
+
+static uint32_t
+symbol_table_id(struct symbol_table* st, struct callpath_node* node) {
+    uint64_t h = (uint64_t)((uintptr_t)node->name);
+    h = h * 0x9E3779B97F4A7C15ULL ^ (uint64_t)((uintptr_t)node->source);
+    h = h * 0x9E3779B97F4A7C15ULL ^ (uint64_t)((uint32_t)node->line);
+    h ^= h >> 29;
+
+    uintptr_t v = 0;
+    while ((v = (uintptr_t)imap_query(st->map, h)) != 0) {
+        struct callpath_node* sym = st->symbols[v - 1];
+        if (sym->name == node->name && sym->source == node->source && sym->line == node->line) {
+            return (uint32_t)(v - 1);
+        }
+        // another symbol has the same hash, probe the next key
+        h = h * 0x9E3779B97F4A7C15ULL + 1;
+    }
+
+    if (st->size >= st->cap) {
+        st->cap = st->cap > 0 ? st->cap * 2 : 256;
+        st->symbols = (struct callpath_node**)prealloc(st->symbols, sizeof(struct callpath_node*) * st->cap);
+    }
+    uint32_t id = (uint32_t)st->size++;
+    st->symbols[id] = node;
+    imap_set(st->map, h, (void*)((uintptr_t)id + 1));
+    return id;
+}
+
+
+struct string_buffer {
+    struct imap_context* map;           // const char* -> offset + 1
+    char* data;
+    size_t size;
+    size_t cap;
+};
+
+static uint32_t
+string_buffer_add(struct string_buffer* sb, const char* s) {
+    if (!s) {
+        s = "";
+    }
+    uint64_t key = (uint64_t)((uintptr_t)s);
+    uintptr_t v = (uintptr_t)imap_query(sb->map, key);
+    if (v) {
+        return (uint32_t)(v - 1);
+    }
+    size_t len = strlen(s) + 1;
+    while (sb->size + len > sb->cap) {
+        sb->cap = sb->cap > 0 ? sb->cap * 2 : 4096;
+        sb->data = (char*)prealloc(sb->data, sb->cap);
+    }
+    uint32_t offset = (uint32_t)sb->size;
+    memcpy(sb->data + offset, s, len);
+    sb->size += len;
+    imap_set(sb->map, key, (void*)((uintptr_t)offset + 1));
+    return offset;
+}
+
+// c.dump{layout="columnar"}: flat arrays instead of one table per node
+enum columnar_field {
+    CF_PARENT,
+    CF_SYMBOL,
+    CF_COUNT,
+    CF_VALUE,
+    CF_ALLOC,
+    CF_GC,
+    CF_SYMBOLS,
+    CF_MAX,
+};
+
+static const char* columnar_names[CF_MAX] = {
+    "parent", "symbol", "count", "value", "alloc", "gc", "symbols",
+};
+
+// the column tables are at col .. col + CF_MAX - 1
+static uint32_t
+columnar_symbol(lua_State* L, int col, struct symbol_table* st, struct callpath_node* node) {
+    size_t nsymbol = st->size;
+    uint32_t symbol = symbol_table_id(st, node);
+    if (st->size > nsymbol) {
+        char name[512] = {0};
+        snprintf(name, sizeof(name)-1, "%s %s:%d", node->name ? node->name : "", node->source ? node->source : "", node->line);
+        lua_pushstring(L, name);
+        lua_rawseti(L, col + CF_SYMBOLS, symbol + 1);
+    }
+    return symbol;
+}
+
+static void
+columnar_set_row(lua_State* L, int col, lua_Integer idx, struct flat_node* flat, uint32_t symbol) {
+    lua_pushinteger(L, flat->parent == FLAT_NONE ? 0 : (lua_Integer)flat->parent + 1);
+    lua_rawseti(L, col + CF_PARENT, idx);
+    lua_pushinteger(L, (lua_Integer)symbol + 1);
+    lua_rawseti(L, col + CF_SYMBOL, idx);
+    lua_pushinteger(L, flat->count);
+    lua_rawseti(L, col + CF_COUNT, idx);
+    lua_pushinteger(L, flat->value);
+    lua_rawseti(L, col + CF_VALUE, idx);
+    lua_pushinteger(L, flat->alloc_count);
+    lua_rawseti(L, col + CF_ALLOC, idx);
+    lua_pushinteger(L, flat->gc_time);
+    lua_rawseti(L, col + CF_GC, idx);
+}
+
+// windows of node k, oldest first, are at k*windows + 1 .. (k+1)*windows of the series arrays
+static void
+dump_series(lua_State* L, struct profile_context* context, struct flat_tree* tree) {
+    uint64_t size = (uint64_t)context->series_size;
+    uint64_t epoch = series_advance(context, gettime());
+    lua_Integer n = (lua_Integer)(tree->size * size);
+
+    lua_checkstack(L, 4);
+    lua_pushinteger(L, (lua_Integer)size);
+    lua_setfield(L, -2, "windows");
+    lua_pushinteger(L, (lua_Integer)(realtime(context->series_period) * 1000));
+    lua_setfield(L, -2, "period");
+    lua_createtable(L, (int)n, 0);
+    lua_createtable(L, (int)n, 0);
+    lua_createtable(L, (int)n, 0);
+
+    lua_Integer idx = 0;
+    size_t k = 0;
+    for (k = 0; k < tree->size; k++) {
+        struct callpath_node* node = (struct callpath_node*)icallpath_getvalue(tree->nodes[k].path);
+        uint64_t j = 0;
+        for (j = 0; j < size; j++) {
+            // a node only holds the windows up to its last update
+            struct series_slot* slot = NULL;
+            int64_t w = (int64_t)epoch - (int64_t)(size - 1) + (int64_t)j;
+            if (node->series && w >= 0 && (uint64_t)w <= node->series_epoch && (uint64_t)w + size > node->series_epoch) {
+                slot = &node->series[w % size];
+            }
+            idx++;
+            lua_pushinteger(L, slot ? slot->count : 0);
+            lua_rawseti(L, -4, idx);
+            lua_pushinteger(L, slot ? (lua_Integer)(realtime(slot->record_time) * MICROSEC) : 0);
+            lua_rawseti(L, -3, idx);
+            lua_pushinteger(L, slot ? slot->alloc_count : 0);
+            lua_rawseti(L, -2, idx);
+        }
+    }
+    lua_setfield(L, -4, "series_alloc");
+    lua_setfield(L, -3, "series_value");
+    lua_setfield(L, -2, "series_count");
+}
+
+static void
+dump_columnar(lua_State* L, struct profile_context* context, double scale) {
+    struct flat_tree tree;
+    flat_tree_build(&tree, context->callpath);
+    flat_tree_aggregate(&tree, scale);
+
+    struct symbol_table st;
+    symbol_table_init(&st);
+
+    lua_checkstack(L, CF_MAX + 3);
+    lua_createtable(L, 0, CF_MAX);
+    int base = lua_gettop(L);
+    int i = 0;
+    for (i = 0; i < CF_MAX; i++) {
+        lua_createtable(L, i == CF_SYMBOLS ? 0 : (int)tree.size, 0);
+    }
+
+    size_t k = 0;
+    for (k = 0; k < tree.size; k++) {
+        struct flat_node* flat = &tree.nodes[k];
+        struct callpath_node* node = (struct callpath_node*)icallpath_getvalue(flat->path);
+        uint32_t symbol = columnar_symbol(L, base + 1, &st, node);
+
+        columnar_set_row(L, base + 1, (lua_Integer)k + 1, flat, symbol);
+    }
+
+    for (i = CF_MAX - 1; i >= 0; i--) {
+        lua_setfield(L, base, columnar_names[i]);
+    }
+    if (context->series_size > 0) {
+        dump_series(L, context, &tree);
+    }
+    symbol_table_free(&st);
+    flat_tree_free(&tree);
+}
+
+// c.dump_begin/dump_step/dump_end: the columnar dump of one snapshot, spread over several calls
+// the nodes are visited breadth first, then aggregated bottom up, both phases resume where they stopped
+struct dump_cursor {
+    int         ref;                // result table in the registry
+    uint64_t    record_time;
+    double      coverage;
+    size_t      next;
+    size_t      agg;                // nodes left to aggregate, counted down
+    bool        done;
+    struct flat_node*   sum;        // sum of the children of every node
+    struct flat_tree    tree;       // grows breadth first as the nodes are visited
+    struct symbol_table st;
+};
+
+struct dump_cursor_arg {
+    struct flat_tree* tree;
+    uint32_t parent;
+    uint32_t epoch;
+};
+
+static void
+_dump_cursor_child(uint64_t key, void* value, void* ud) {
+    struct dump_cursor_arg* arg = (struct dump_cursor_arg*)ud;
+    struct icallpath_context* path = (struct icallpath_context*)value;
+    struct callpath_node* node = (struct callpath_node*)icallpath_getvalue(path);
+    // children created after dump_begin are not part of the snapshot
+    if (node->born_epoch != arg->epoch) {
+        _flat_tree_push(arg->tree, path, arg->parent);
+    }
+}
+
+// push the result table and its CF_MAX columns, return the index of the first column
+static int
+dump_cursor_columns(lua_State* L, struct dump_cursor* cursor) {
+    lua_checkstack(L, CF_MAX + 3);
+    lua_rawgeti(L, LUA_REGISTRYINDEX, cursor->ref);
+    int col = lua_gettop(L) + 1;
+    int i = 0;
+    for (i = 0; i < CF_MAX; i++) {
+        lua_getfield(L, col - 1, columnar_names[i]);
+    }
+    return col;
+}
+
+static inline bool
+dump_cursor_over(uint64_t begin, uint64_t budget, size_t n) {
+    return budget > 0 && n % DUMP_STEP_CHECK == 0 && gettime() - begin >= budget;
+}
+
+// visit nodes until the budget is spent, return true when every node of the snapshot is written
+static bool
+dump_cursor_walk(lua_State* L, struct profile_context* context, int col, uint64_t begin, uint64_t budget) {
+    struct dump_cursor* cursor = context->cursor;
+    struct flat_tree* tree = &cursor->tree;
+    double scale = 1.0 / cursor->coverage;
+    while (cursor->next < tree->size) {
+        size_t k = cursor->next++;
+        struct flat_node* flat = &tree->nodes[k];
+        struct callpath_node* node = (struct callpath_node*)icallpath_getvalue(flat->path);
+        bool saved = node->snap_epoch == context->snap_epoch;
+        flat->count = (saved ? node->snap_count : node->count) * scale;
+        flat->value = realtime(saved ? node->snap_record_time : node->record_time) * MICROSEC * scale;
+        flat->alloc_count = (saved ? node->snap_alloc_count : node->alloc_count) * scale;
+        flat->gc_time = realtime(saved ? node->snap_gc_time : node->gc_time) * MICROSEC * scale;
+
+        uint32_t symbol = columnar_symbol(L, col, &cursor->st, node);
+        columnar_set_row(L, col, (lua_Integer)k + 1, flat, symbol);
+
+        struct dump_cursor_arg arg;
+        arg.tree = tree;
+        arg.parent = (uint32_t)k;
+        arg.epoch = context->snap_epoch;
+        icallpath_dump_children(flat->path, _dump_cursor_child, &arg);
+
+        if (dump_cursor_over(begin, budget, cursor->next)) {
+            break;
+        }
+    }
+    return cursor->next >= tree->size;
+}
+
+// a node reports at least the sum of its children, like flat_tree_aggregate,
+// only the rows that change are written again; return true when the root is reached
+static bool
+dump_cursor_aggregate(lua_State* L, struct dump_cursor* cursor, int col, uint64_t begin, uint64_t budget) {
+    struct flat_tree* tree = &cursor->tree;
+    while (cursor->agg > 0) {
+        size_t i = --cursor->agg;
+        struct flat_node* flat = &tree->nodes[i];
+        struct flat_node* agg = &cursor->sum[i];
+        bool changed = agg->count > flat->count || agg->value > flat->value
+            || agg->alloc_count > flat->alloc_count || agg->gc_time > flat->gc_time;
+        agg->count = flat->count > agg->count ? flat->count : agg->count;
+        agg->value = flat->value > agg->value ? flat->value : agg->value;
+        agg->alloc_count = flat->alloc_count > agg->alloc_count ? flat->alloc_count : agg->alloc_count;
+        agg->gc_time = flat->gc_time > agg->gc_time ? flat->gc_time : agg->gc_time;
+        if (changed) {
+            lua_Integer idx = (lua_Integer)i + 1;
+            lua_pushinteger(L, agg->count);
+            lua_rawseti(L, col + CF_COUNT, idx);
+            lua_pushinteger(L, agg->value);
+            lua_rawseti(L, col + CF_VALUE, idx);
+            lua_pushinteger(L, agg->alloc_count);
+            lua_rawseti(L, col + CF_ALLOC, idx);
+            lua_pushinteger(L, agg->gc_time);
+            lua_rawseti(L, col + CF_GC, idx);
+        }
+        if (flat->parent != FLAT_NONE) {
+            struct flat_node* parent = &cursor->sum[flat->parent];
+            parent->count += agg->count;
+            parent->value += agg->value;
+            parent->alloc_count += agg->alloc_count;
+            parent->gc_time += agg->gc_time;
+        }
+        if (dump_cursor_over(begin, budget, tree->size - cursor->agg)) {
+            break;
+        }
+    }
+    return cursor->agg == 0;
+}
+
+// run the walk then the aggregation until the budget is spent, return true when the snapshot is complete
+static bool
+dump_cursor_step(lua_State* L, struct profile_context* context, uint64_t budget) {
+    struct dump_cursor* cursor = context->cursor;
+    if (cursor->done) {
+        return true;
+    }
+    uint64_t begin = gettime();
+    int col = dump_cursor_columns(L, cursor);
+
+    if (!cursor->sum) {
+        if (dump_cursor_walk(L, context, col, begin, budget)) {
+            // every counter of the snapshot is read, the hook can stop preserving them
+            context->snap_active = false;
+            cursor->sum = (struct flat_node*)pcalloc(cursor->tree.size, sizeof(struct flat_node));
+            cursor->agg = cursor->tree.size;
+        }
+    }
+    if (cursor->sum && !dump_cursor_over(begin, budget, DUMP_STEP_CHECK)) {
+        if (dump_cursor_aggregate(L, cursor, col, begin, budget)) {
+            pfree(cursor->sum);
+            cursor->sum = NULL;
+            cursor->done = true;
+        }
+    }
+    lua_settop(L, col - 2);
+    return cursor->done;
+}
+
+static void
+dump_cursor_free(lua_State* L, struct profile_context* context) {
+    struct dump_cursor* cursor = context->cursor;
+    if (!cursor) {
+        return;
+    }
+    luaL_unref(L, LUA_REGISTRYINDEX, cursor->ref);
+    pfree(cursor->sum);
+    symbol_table_free(&cursor->st);
+    flat_tree_free(&cursor->tree);
+    pfree(cursor);
+    context->cursor = NULL;
+    context->snap_active = false;
+}
+
+static int
+save_call_path(struct icallpath_context* root, uint64_t record_time, double scale, const char* filename) {
+    FILE* f = fopen(filename, "wb");
+    if (!f) {
+        return -1;
+    }
+
+    struct flat_tree tree;
+    flat_tree_build(&tree, root);
+    flat_tree_aggregate(&tree, scale);
+
+    struct symbol_table st;
+    symbol_table_init(&st);
+    struct psnap_node* nodes = (struct psnap_node*)pmalloc(sizeof(struct psnap_node) * tree.size);
+    size_t i = 0;
+    for (i = 0; i < tree.size; i++) {
+        struct flat_node* flat = &tree.nodes[i];
+        struct callpath_node* node = (struct callpath_node*)icallpath_getvalue(flat->path);
+        nodes[i].parent = flat->parent == FLAT_NONE ? PSNAP_NONE : flat->parent;
+        nodes[i].symbol = symbol_table_id(&st, node);
+        nodes[i].count = flat->count;
+        nodes[i].value = flat->value;
+        nodes[i].alloc_count = flat->alloc_count;
+    }
+
+    struct string_buffer sb;
+    sb.map = imap_create();
+    sb.data = NULL;
+    sb.size = 0;
+    sb.cap = 0;
+    struct psnap_symbol* symbols = (struct psnap_symbol*)pmalloc(sizeof(struct psnap_symbol) * (st.size + 1));
+    for (i = 0; i < st.size; i++) {
+        struct callpath_node* node = st.symbols[i];
+        symbols[i].name = string_buffer_add(&sb, node->name);
+        symbols[i].source = string_buffer_add(&sb, node->source);
+        symbols[i].line = node->line;
+    }
+
+    struct psnap_header hdr;
+    hdr.magic = PSNAP_MAGIC;
+    hdr.version = PSNAP_VERSION;
+    hdr.node_count = (uint32_t)tree.size;
+    hdr.symbol_count = (uint32_t)st.size;
+    hdr.string_size = (uint32_t)sb.size;
+    hdr.reserved = 0;
+    hdr.record_time = record_time;
+
+    int ret = 0;
+    if (fwrite(&hdr, sizeof(hdr), 1, f) != 1
+        || fwrite(symbols, sizeof(struct psnap_symbol), st.size, f) != st.size
+        || fwrite(nodes, sizeof(struct psnap_node), tree.size, f) != tree.size
+        || fwrite(sb.data, 1, sb.size, f) != sb.size) {
+        ret = -1;
+    }
+    if (fclose(f) != 0) {
+        ret = -1;
+    }
+
+    pfree(symbols);
+    pfree(nodes);
+    pfree(sb.data);
+    imap_free(sb.map);
+    symbol_table_free(&st);
+    flat_tree_free(&tree);
+    return ret;
+}
+
+
 static int 
 get_all_coroutines(lua_State* L, lua_State** result, int maxsize) {
     int i = 0;
@@ -448,25 +1724,133 @@ get_all_coroutines(lua_State* L, lua_State** result, int maxsize) {
     return i;
 }
 
+// features = {"time", "alloc", "coroutine", "stats"}, time is always on, default is time, alloc and coroutine
+static int
+check_features(lua_State* L, int idx) {
+    if (!lua_istable(L, idx)) {
+        return PF_DEFAULT;
+    }
+    lua_getfield(L, idx, "features");
+    if (lua_isnoneornil(L, -1)) {
+        lua_pop(L, 1);
+        return PF_DEFAULT;
+    }
+    luaL_checktype(L, -1, LUA_TTABLE);
+    int features = 0;
+    lua_Integer i = 0;
+    for (i = 1; lua_rawgeti(L, -1, i) != LUA_TNIL; i++) {
+        const char* name = lua_tostring(L, -1);
+        if (name && strcmp(name, "alloc") == 0) {
+            features |= PF_ALLOC;
+        } else if (name && strcmp(name, "coroutine") == 0) {
+            features |= PF_COROUTINE;
+        } else if (name && strcmp(name, "stats") == 0) {
+            features |= PF_STATS;
+        } else if (!name || strcmp(name, "time") != 0) {
+            return luaL_error(L, "unknown profile feature: %s", name ? name : "?");
+        }
+        lua_pop(L, 1);
+    }
+    lua_pop(L, 2);
+    return features;
+}
+
 static int
 _lstart(lua_State* L) {
     struct profile_context* context = _get_profile(L);
     if (context) {
         return 0;
     }
+    int features = check_features(L, 1);
+
+    // every option is read before anything is created, a bad value throws without leaking
+    const char* shm_name = NULL;
+    lua_Integer node_cap = DEFAULT_SHM_NODES;
+    lua_Integer string_cap = DEFAULT_SHM_STRINGS;
+    double budget = 0;
+    lua_Integer budget_window = DEFAULT_BUDGET_WINDOW;
+    bool track_gc = false;
+    lua_Integer series_size = 0;
+    lua_Integer series_period = DEFAULT_SERIES_PERIOD;
+    if (lua_istable(L, 1)) {
+        lua_getfield(L, 1, "shm_nodes");
+        lua_getfield(L, 1, "shm_strings");
+        node_cap = luaL_optinteger(L, -2, DEFAULT_SHM_NODES);
+        string_cap = luaL_optinteger(L, -1, DEFAULT_SHM_STRINGS);
+        lua_pop(L, 2);
+        if (node_cap <= 0 || node_cap > UINT32_MAX || string_cap <= 0 || string_cap > UINT32_MAX) {
+            return luaL_error(L, "invalid shm_nodes or shm_strings");
+        }
+
+        lua_getfield(L, 1, "budget");
+        lua_getfield(L, 1, "budget_window");
+        budget = luaL_optnumber(L, -2, 0);
+        budget_window = luaL_optinteger(L, -1, DEFAULT_BUDGET_WINDOW);
+        lua_pop(L, 2);
+        if (budget < 0 || budget_window <= 0) {
+            return luaL_error(L, "invalid budget or budget_window");
+        }
+
+        lua_getfield(L, 1, "gc");
+        track_gc = lua_toboolean(L, -1);
+        lua_pop(L, 1);
+
+        lua_getfield(L, 1, "windows");
+        lua_getfield(L, 1, "window_period");
+        series_size = luaL_optinteger(L, -2, 0);
+        series_period = luaL_optinteger(L, -1, DEFAULT_SERIES_PERIOD);
+        lua_pop(L, 2);
+        if (series_size < 0 || series_size > INT_MAX || series_period <= 0) {
+            return luaL_error(L, "invalid windows or window_period");
+        }
+
+        // left on the stack, the name stays valid until the segment is created
+        lua_getfield(L, 1, "shm");
+        shm_name = lua_tostring(L, -1);
+    }
+
     // ProfilerStart("my.prof");
     // init registry
     context = profile_create();
 
     context->start = gettime();
+    if (shm_name) {
+        context->shm = pshm_create(shm_name, (uint32_t)node_cap, (uint32_t)string_cap, TICKS_PER_SEC, context->start);
+        if (!context->shm) {
+            int err = errno;
+            profile_free(context);
+            return luaL_error(L, "profile shm %s: %s", shm_name, strerror(err));
+        }
+    }
+    context->budget = budget;
+    context->budget_window = (uint64_t)budget_window * (TICKS_PER_SEC / 1000);
+    context->window_start = context->start;
+    context->track_gc = track_gc;
+    context->series_size = (int)series_size;
+    context->series_period = (uint64_t)series_period * (TICKS_PER_SEC / 1000);
+    context->series_epoch_end = context->start + context->series_period;
+    if (context->track_gc) {
+        features |= PF_ALLOC | PF_STATS;
+    }
+    if (context->budget > 0) {
+        features |= PF_STATS;
+    }
+    context->features = features;
+    context->hook = hook_variants[features];
+    context->gstate = G(L);
+    context->gc_state = context->gstate->gcstate;
+    context->gc_debt = context->gstate->GCdebt;
+    context->last_alloc_time = context->start;
     context->last_alloc_f = lua_getallocf(L, &context->last_alloc_ud);
     ((struct snlua*)(context->last_alloc_ud))->context = context;
-    lua_setallocf(L, _resolve_alloc, context->last_alloc_ud);
+    if (features & PF_ALLOC) {
+        lua_setallocf(L, _resolve_alloc, context->last_alloc_ud);
+    }
 
     lua_State* states[MAX_CO_SIZE] = {0};
     int i = get_all_coroutines(L, states, MAX_CO_SIZE);
     for (i = i - 1; i >= 0; i--) {
-        lua_sethook(states[i], _resolve_hook, LUA_MASKCALL | LUA_MASKRET, 0);
+        lua_sethook(states[i], context->hook, LUA_MASKCALL | LUA_MASKRET, 0);
     }
     context->increment_alloc_count = true;
     return 0;
@@ -491,6 +1875,7 @@ _lstop(lua_State* L) {
     for (i = i - 1; i >= 0; i--) {
         lua_sethook(states[i], NULL, 0, 0);
     }
+    dump_cursor_free(L, context);
     profile_free(context);
     return 0;
 }
@@ -506,7 +1891,7 @@ _lmark(lua_State* L) {
         co = L;
     }
     if(context->start != 0) {
-        lua_sethook(co, _resolve_hook, LUA_MASKCALL | LUA_MASKRET, 0);
+        lua_sethook(co, context->hook, LUA_MASKCALL | LUA_MASKRET, 0);
     }
     lua_pushboolean(L, context->start != 0);
     return 1;
@@ -530,16 +1915,387 @@ static int
 _ldump(lua_State* L) {
     struct profile_context* context = _get_profile(L);
     if (context && context->callpath) {
+        bool columnar = false;
+        if (lua_istable(L, 1)) {
+            lua_getfield(L, 1, "layout");
+            const char* layout = lua_tostring(L, -1);
+            columnar = layout && strcmp(layout, "columnar") == 0;
+            lua_pop(L, 1);
+        }
         context->increment_alloc_count = false;
-        uint64_t record_time = realtime(gettime() - context->start) * MICROSEC;
+        uint64_t now = gettime();
+        uint64_t record_time = realtime(now - context->start) * MICROSEC;
+        double coverage = profile_coverage(context, now);
         lua_pushinteger(L, record_time);
-        dump_call_path(L, context->callpath);
+        if (columnar) {
+            dump_columnar(L, context, 1.0 / coverage);
+        } else {
+            dump_call_path(L, context->callpath, 1.0 / coverage);
+        }
+        lua_pushnumber(L, coverage);
         context->increment_alloc_count = true;
-        return 2;
+        return 3;
+    }
+    return 0;
+}
+
+static int
+_lsave(lua_State* L) {
+    const char* filename = luaL_checkstring(L, 1);
+    struct profile_context* context = _get_profile(L);
+    if (context && context->callpath) {
+        context->increment_alloc_count = false;
+        uint64_t now = gettime();
+        uint64_t record_time = realtime(now - context->start) * MICROSEC;
+        int ret = save_call_path(context->callpath, record_time, 1.0 / profile_coverage(context, now), filename);
+        context->increment_alloc_count = true;
+        if (ret != 0) {
+            lua_pushnil(L);
+            lua_pushfstring(L, "%s: %s", filename, strerror(errno));
+            return 2;
+        }
+        lua_pushboolean(L, true);
+        return 1;
     }
     return 0;
 }
 
+// c.lines(func or source pattern): line level profiling of the matching prototypes
+static int
+_llines(lua_State* L) {
+    struct profile_context* context = _get_profile(L);
+    if (!context) {
+        return 0;
+    }
+    if (!context->line_protos) {
+        context->line_protos = imap_create();
+        context->line_skip = imap_create();
+    }
+
+    if (lua_isfunction(L, 1) && !lua_iscfunction(L, 1)) {
+        const LClosure* cl = (const LClosure*)lua_topointer(L, 1);
+        uint64_t key = (uint64_t)((uintptr_t)cl->p);
+        if (!imap_query(context->line_protos, key)) {
+            imap_remove(context->line_skip, key);
+            line_profile_create(context, cl->p);
+        }
+    } else {
+        size_t sz = 0;
+        const char* pattern = luaL_checklstring(L, 1, &sz);
+        if (context->line_pattern_count >= MAX_LINE_PATTERN) {
+            return luaL_error(L, "too many line patterns");
+        }
+        char* p = (char*)pmalloc(sz + 1);
+        memcpy(p, pattern, sz + 1);
+        context->line_patterns[context->line_pattern_count++] = p;
+        // prototypes skipped before may match the new pattern
+        imap_free(context->line_skip);
+        context->line_skip = imap_create();
+    }
+    lua_pushboolean(L, true);
+    return 1;
+}
+
+struct dump_lines_arg {
+    lua_State* L;
+    lua_Integer index;
+};
+
+static void
+_dump_line_profile(uint64_t key, void* value, void* ud) {
+    struct dump_lines_arg* arg = (struct dump_lines_arg*)ud;
+    struct line_profile* lp = (struct line_profile*)value;
+    lua_State* L = arg->L;
+
+    lua_createtable(L, 0, 5);
+    lua_pushstring(L, lp->source);
+    lua_setfield(L, -2, "source");
+    lua_pushinteger(L, lp->linedefined);
+    lua_setfield(L, -2, "linedefined");
+
+    lua_newtable(L);
+    lua_newtable(L);
+    lua_newtable(L);
+    lua_Integer n = 0;
+    int i = 0;
+    for (i = 0; i < lp->size; i++) {
+        if (lp->hits[i] == 0) {
+            continue;
+        }
+        n++;
+        lua_pushinteger(L, lp->linedefined + i);
+        lua_rawseti(L, -4, n);
+        lua_pushinteger(L, lp->hits[i]);
+        lua_rawseti(L, -3, n);
+        lua_pushinteger(L, (lua_Integer)(realtime(lp->time[i]) * MICROSEC));
+        lua_rawseti(L, -2, n);
+    }
+    lua_setfield(L, -4, "time");
+    lua_setfield(L, -3, "hits");
+    lua_setfield(L, -2, "line");
+
+    lua_rawseti(L, -2, ++arg->index);
+}
+
+// {{source=, linedefined=, line={...}, hits={...}, time={...}}, ...}
+static int
+_ldump_lines(lua_State* L) {
+    struct profile_context* context = _get_profile(L);
+    if (!context || !context->line_protos) {
+        return 0;
+    }
+    context->increment_alloc_count = false;
+    lua_checkstack(L, 8);
+    lua_newtable(L);
+    struct dump_lines_arg arg;
+    arg.L = L;
+    arg.index = 0;
+    imap_dump(context->line_protos, _dump_line_profile, &arg);
+    context->increment_alloc_count = true;
+    return 1;
+}
+
+static void
+_ob_call_state_bytes(uint64_t key, void* value, void* ud) {
+    struct call_state* cs = (struct call_state*)value;
+    size_t* bytes = (size_t*)ud;
+    *bytes += sizeof(struct call_state) + sizeof(struct call_frame) * MAX_CALL_SIZE;
+    if (cs->gc_list) {
+        *bytes += sizeof(struct frame_gc) * MAX_CALL_SIZE;
+    }
+    if (cs->line_list) {
+        *bytes += sizeof(struct frame_line) * MAX_CALL_SIZE;
+    }
+    if (cs->slow_list) {
+        *bytes += sizeof(struct frame_slow) * MAX_CALL_SIZE;
+    }
+}
+
+// reads the counters kept up to date by the hook and walks the coroutines once, cheap enough for a monitoring poll
+static int
+_lstats(lua_State* L) {
+    struct profile_context* context = _get_profile(L);
+    if (!context) {
+        return 0;
+    }
+    context->increment_alloc_count = false;
+    uint64_t now = gettime();
+    double elapsed = realtime(now - context->start);
+
+    size_t nodes = 0;
+    size_t node_bytes = 0;
+    size_t rehash = imap_rehash_count(context->cs_map);
+    if (context->callpath) {
+        nodes = icallpath_tree_size(context->callpath);
+        node_bytes = icallpath_tree_memsize(context->callpath) + nodes * sizeof(struct callpath_node);
+        rehash += icallpath_tree_rehash_count(context->callpath);
+    }
+    size_t call_states = imap_size(context->cs_map);
+    size_t call_state_bytes = imap_memsize(context->cs_map);
+    imap_dump(context->cs_map, _ob_call_state_bytes, &call_state_bytes);
+    size_t line_bytes = context->line_bytes;
+    if (context->line_protos) {
+        line_bytes += imap_memsize(context->line_protos) + imap_memsize(context->line_skip);
+        rehash += imap_rehash_count(context->line_protos) + imap_rehash_count(context->line_skip);
+    }
+
+    lua_createtable(L, 0, 12);
+    lua_pushinteger(L, (lua_Integer)(elapsed * MICROSEC));
+    lua_setfield(L, -2, "elapsed");
+    lua_pushinteger(L, context->hook_events);
+    lua_setfield(L, -2, "events");
+    lua_pushnumber(L, elapsed > 0 ? context->hook_events / elapsed : 0);
+    lua_setfield(L, -2, "events_per_sec");
+    lua_pushnumber(L, context->hook_events > 0 ? realtime(context->hook_time) * NANOSEC / context->hook_events : 0);
+    lua_setfield(L, -2, "hook_avg_ns");
+    lua_pushinteger(L, (lua_Integer)(realtime(context->hook_max) * NANOSEC));
+    lua_setfield(L, -2, "hook_max_ns");
+    lua_pushnumber(L, elapsed > 0 ? realtime(context->hook_time) / elapsed : 0);
+    lua_setfield(L, -2, "overhead");
+    lua_pushnumber(L, profile_coverage(context, now));
+    lua_setfield(L, -2, "coverage");
+    lua_pushinteger(L, nodes);
+    lua_setfield(L, -2, "nodes");
+    lua_pushinteger(L, node_bytes);
+    lua_setfield(L, -2, "node_bytes");
+    lua_pushinteger(L, call_states);
+    lua_setfield(L, -2, "call_states");
+    lua_pushinteger(L, call_state_bytes);
+    lua_setfield(L, -2, "call_state_bytes");
+    lua_pushinteger(L, line_bytes);
+    lua_setfield(L, -2, "line_bytes");
+    lua_pushinteger(L, rehash);
+    lua_setfield(L, -2, "rehash");
+    context->increment_alloc_count = true;
+    return 1;
+}
+
+// c.on_slow(threshold_us [, ring_size]): record the calls slower than threshold, 0 turns it off
+static int
+_lon_slow(lua_State* L) {
+    struct profile_context* context = _get_profile(L);
+    if (!context) {
+        return 0;
+    }
+    lua_Integer threshold = luaL_checkinteger(L, 1);
+    lua_Integer cap = luaL_optinteger(L, 2, DEFAULT_SLOW_RING);
+    luaL_argcheck(L, threshold >= 0, 1, "negative threshold");
+    luaL_argcheck(L, cap > 0, 2, "ring size must be positive");
+
+    context->slow_threshold = 0;
+    if ((size_t)cap != context->slow_cap) {
+        pfree(context->slow_ring);
+        context->slow_ring = (struct slow_record*)pmalloc(sizeof(struct slow_record) * cap);
+        context->slow_cap = (size_t)cap;
+        context->slow_head = 0;
+        context->slow_count = 0;
+    }
+    context->slow_threshold = (uint64_t)(threshold * (TICKS_PER_SEC / (double)MICROSEC));
+    lua_pushboolean(L, true);
+    return 1;
+}
+
+static void
+_push_frame_name(lua_State* L, struct callpath_node* node) {
+    lua_pushfstring(L, "%s %s:%d", node->name ? node->name : "", node->source ? node->source : "", node->line);
+}
+
+// drain the slow call ring, oldest first:
+// {{time=, inclusive=, exclusive=, alloc=, stack={outermost, ..., slow call}, heaviest=, heaviest_time=}, ...}, dropped
+static int
+_ldump_slow(lua_State* L) {
+    struct profile_context* context = _get_profile(L);
+    if (!context || !context->slow_ring) {
+        return 0;
+    }
+    context->increment_alloc_count = false;
+    lua_checkstack(L, 6);
+    lua_createtable(L, (int)context->slow_count, 0);
+    size_t first = (context->slow_head + context->slow_cap - context->slow_count) % context->slow_cap;
+    size_t i = 0;
+    for (i = 0; i < context->slow_count; i++) {
+        struct slow_record* r = &context->slow_ring[(first + i) % context->slow_cap];
+        lua_createtable(L, 0, 7);
+        lua_pushinteger(L, (lua_Integer)(realtime(r->ret_time - context->start) * MICROSEC));
+        lua_setfield(L, -2, "time");
+        lua_pushinteger(L, (lua_Integer)(realtime(r->inclusive) * MICROSEC));
+        lua_setfield(L, -2, "inclusive");
+        lua_pushinteger(L, (lua_Integer)(realtime(r->exclusive) * MICROSEC));
+        lua_setfield(L, -2, "exclusive");
+        lua_pushinteger(L, r->alloc_count);
+        lua_setfield(L, -2, "alloc");
+
+        // the root "total" node is not a frame
+        int depth = 0;
+        struct callpath_node* node = r->node;
+        for (; node && node->parent; node = node->parent) {
+            depth++;
+        }
+        lua_createtable(L, depth, 0);
+        int k = depth;
+        for (node = r->node; node && node->parent; node = node->parent) {
+            _push_frame_name(L, node);
+            lua_rawseti(L, -2, k--);
+        }
+        lua_setfield(L, -2, "stack");
+
+        if (r->max_child) {
+            _push_frame_name(L, r->max_child);
+            lua_setfield(L, -2, "heaviest");
+            lua_pushinteger(L, (lua_Integer)(realtime(r->max_child_cost) * MICROSEC));
+            lua_setfield(L, -2, "heaviest_time");
+        }
+        lua_rawseti(L, -2, (lua_Integer)i + 1);
+    }
+    lua_pushinteger(L, context->slow_dropped);
+    context->slow_head = 0;
+    context->slow_count = 0;
+    context->slow_dropped = 0;
+    context->increment_alloc_count = true;
+    return 2;
+}
+
+static int
+_ldump_begin(lua_State* L) {
+    struct profile_context* context = _get_profile(L);
+    if (!context || !context->callpath) {
+        return 0;
+    }
+    context->increment_alloc_count = false;
+    dump_cursor_free(L, context);
+
+    struct dump_cursor* cursor = (struct dump_cursor*)pmalloc(sizeof(*cursor));
+    uint64_t now = gettime();
+    cursor->record_time = realtime(now - context->start) * MICROSEC;
+    cursor->coverage = profile_coverage(context, now);
+    cursor->next = 0;
+    cursor->agg = 0;
+    cursor->done = false;
+    cursor->sum = NULL;
+    cursor->tree.nodes = NULL;
+    cursor->tree.size = 0;
+    cursor->tree.cap = 0;
+    _flat_tree_push(&cursor->tree, context->callpath, FLAT_NONE);
+    symbol_table_init(&cursor->st);
+
+    lua_checkstack(L, 2);
+    lua_createtable(L, 0, CF_MAX);
+    int i = 0;
+    for (i = 0; i < CF_MAX; i++) {
+        lua_newtable(L);
+        lua_setfield(L, -2, columnar_names[i]);
+    }
+    cursor->ref = luaL_ref(L, LUA_REGISTRYINDEX);
+
+    context->cursor = cursor;
+    context->snap_epoch++;
+    if (context->snap_epoch == 0) {
+        context->snap_epoch = 1;    // 0 is the born epoch of the nodes created outside of a snapshot
+    }
+    context->snap_active = true;
+    context->increment_alloc_count = true;
+    lua_pushboolean(L, true);
+    return 1;
+}
+
+// c.dump_step(budget_us): return true when the snapshot is completely written
+static int
+_ldump_step(lua_State* L) {
+    struct profile_context* context = _get_profile(L);
+    if (!context || !context->cursor) {
+        return 0;
+    }
+    lua_Integer budget = luaL_optinteger(L, 1, 0);
+    context->increment_alloc_count = false;
+    bool done = dump_cursor_step(L, context, (uint64_t)(budget * (TICKS_PER_SEC / (double)MICROSEC)));
+    context->increment_alloc_count = true;
+    lua_pushboolean(L, done);
+    return 1;
+}
+
+// c.dump_end(): once dump_step returned true, return the same values as c.dump{layout="columnar"}
+static int
+_ldump_end(lua_State* L) {
+    struct profile_context* context = _get_profile(L);
+    if (!context || !context->cursor) {
+        return 0;
+    }
+    struct dump_cursor* cursor = context->cursor;
+    if (!cursor->done) {
+        lua_pushnil(L);
+        lua_pushstring(L, "dump is not complete, call dump_step until it returns true");
+        return 2;
+    }
+    context->increment_alloc_count = false;
+    lua_checkstack(L, 3);
+    lua_pushinteger(L, cursor->record_time);
+    lua_rawgeti(L, LUA_REGISTRYINDEX, cursor->ref);
+    lua_pushnumber(L, cursor->coverage);
+    dump_cursor_free(L, context);
+    context->increment_alloc_count = true;
+    return 3;
+}
+
 int
 luaopen_profile_c(lua_State* L) {
     luaL_checkversion(L);
@@ -549,6 +2305,15 @@ luaopen_profile_c(lua_State* L) {
         {"mark", _lmark},
         {"unmark", _lunmark},
         {"dump", _ldump},
+        {"save", _lsave},
+        {"lines", _llines},
+        {"dump_lines", _ldump_lines},
+        {"stats", _lstats},
+        {"on_slow", _lon_slow},
+        {"dump_slow", _ldump_slow},
+        {"dump_begin", _ldump_begin},
+        {"dump_step", _ldump_step},
+        {"dump_end", _ldump_end},
         {NULL, NULL},
     };
     luaL_newlib(L, l);
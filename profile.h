@@ -17,4 +17,11 @@
 #define pfree  free
 #define pcalloc calloc
 
+// the consistency checks on the hook path are only compiled with PROFILE_DEBUG
+#ifdef PROFILE_DEBUG
+    #define passert(e)  assert(e)
+#else
+    #define passert(e)  ((void)0)
+#endif
+
 #endif
\ No newline at end of file
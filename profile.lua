@@ -9,21 +9,21 @@ local old_co_wrap = coroutine.wrap
 
 
 local exists = 0
-function M.start()
+function M.start(opts)
     if exists == 0 then
-        c.start()
+        c.start(opts)
     end
     exists = exists + 1
 end
 
-function M.stop()
-    local record_time, nodes = c.dump()
+function M.stop(opts)
+    local record_time, nodes, coverage = c.dump(opts)
     exists = exists - 1
     if exists <= 0  then
         exists = 0
         c.stop()
     end
-    return {time = record_time, nodes = nodes}
+    return {time = record_time, nodes = nodes, coverage = coverage}
 end
 
 
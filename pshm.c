@@ -0,0 +1,161 @@
+#include "profile.h"
+#include "pshm.h"
+#include "imap.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+struct pshm_context {
+    char    name[256];
+    size_t  size;
+    struct pshm_header*     hdr;
+    struct imap_context*    strings;    // const char* -> offset + 1
+};
+
+// a segment whose writer process is gone is left over from a crash, it can be reused
+static bool
+_pshm_stale(const char* name) {
+    int fd = shm_open(name, O_RDONLY, 0);
+    if (fd < 0) {
+        return false;
+    }
+    struct stat st;
+    bool stale = false;
+    if (fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(struct pshm_header)) {
+        void* p = mmap(NULL, sizeof(struct pshm_header), PROT_READ, MAP_SHARED, fd, 0);
+        if (p != MAP_FAILED) {
+            struct pshm_header* hdr = (struct pshm_header*)p;
+            stale = __atomic_load_n(&hdr->magic, __ATOMIC_ACQUIRE) == PSHM_MAGIC
+                && kill((pid_t)hdr->pid, 0) != 0 && errno == ESRCH;
+            munmap(p, sizeof(struct pshm_header));
+        }
+    }
+    close(fd);
+    return stale;
+}
+
+struct pshm_context *
+pshm_create(const char* name, uint32_t node_cap, uint32_t string_cap, uint64_t ticks_per_sec, uint64_t start) {
+    struct pshm_context* shm = (struct pshm_context*)pmalloc(sizeof(*shm));
+    if (name[0] == '/') {
+        snprintf(shm->name, sizeof(shm->name), "%s", name);
+    } else {
+        snprintf(shm->name, sizeof(shm->name), "/%s", name);
+    }
+    shm->size = pshm_size(node_cap, string_cap);
+
+    int fd = shm_open(shm->name, O_RDWR | O_CREAT | O_EXCL, 0644);
+    if (fd < 0 && errno == EEXIST && _pshm_stale(shm->name)) {
+        shm_unlink(shm->name);
+        fd = shm_open(shm->name, O_RDWR | O_CREAT | O_EXCL, 0644);
+    }
+    if (fd < 0) {
+        int err = errno;
+        pfree(shm);
+        errno = err;
+        return NULL;
+    }
+    if (ftruncate(fd, shm->size) != 0) {
+        int err = errno;
+        close(fd);
+        shm_unlink(shm->name);
+        pfree(shm);
+        errno = err;
+        return NULL;
+    }
+    void* p = mmap(NULL, shm->size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED) {
+        int err = errno;
+        shm_unlink(shm->name);
+        pfree(shm);
+        errno = err;
+        return NULL;
+    }
+
+    struct pshm_header* hdr = (struct pshm_header*)p;
+    hdr->version = PSHM_VERSION;
+    hdr->pid = (uint32_t)getpid();
+    hdr->reserved = 0;
+    hdr->node_cap = node_cap;
+    hdr->node_count = 0;
+    hdr->string_cap = string_cap;
+    hdr->string_size = 0;
+    hdr->ticks_per_sec = ticks_per_sec;
+    hdr->start = start;
+    hdr->now = start;
+    __atomic_store_n(&hdr->magic, PSHM_MAGIC, __ATOMIC_RELEASE);
+
+    shm->hdr = hdr;
+    shm->strings = imap_create();
+    return shm;
+}
+
+void
+pshm_free(struct pshm_context* shm) {
+    munmap(shm->hdr, shm->size);
+    shm_unlink(shm->name);
+    imap_free(shm->strings);
+    pfree(shm);
+}
+
+static uint32_t
+_pshm_add_string(struct pshm_context* shm, const char* s) {
+    uint64_t key = (uint64_t)((uintptr_t)s);
+    uintptr_t v = (uintptr_t)imap_query(shm->strings, key);
+    if (v) {
+        return (uint32_t)(v - 1);
+    }
+
+    struct pshm_header* hdr = shm->hdr;
+    size_t len = strlen(s) + 1;
+    if (hdr->string_size + len > hdr->string_cap) {
+        return PSHM_NONE;
+    }
+    uint32_t offset = hdr->string_size;
+    memcpy(pshm_strings(hdr) + offset, s, len);
+    __atomic_store_n(&hdr->string_size, offset + len, __ATOMIC_RELEASE);
+    imap_set(shm->strings, key, (void*)((uintptr_t)offset + 1));
+    return offset;
+}
+
+uint32_t
+pshm_add_node(struct pshm_context* shm, uint32_t parent, const char* name, const char* source, int line) {
+    struct pshm_header* hdr = shm->hdr;
+    if (hdr->node_count >= hdr->node_cap) {
+        return PSHM_NONE;
+    }
+
+    uint32_t name_off = _pshm_add_string(shm, name);
+    uint32_t source_off = name_off == PSHM_NONE ? PSHM_NONE : _pshm_add_string(shm, source);
+    if (source_off == PSHM_NONE) {
+        return PSHM_NONE;
+    }
+
+    // the node is complete before node_count makes it visible to the readers
+    uint32_t index = hdr->node_count;
+    struct pshm_node* node = &pshm_nodes(hdr)[index];
+    node->parent = parent;
+    node->name = name_off;
+    node->source = source_off;
+    node->line = line;
+    node->seq = 0;
+    node->reserved = 0;
+    node->count = 0;
+    node->record_time = 0;
+    node->alloc_count = 0;
+    __atomic_store_n(&hdr->node_count, index + 1, __ATOMIC_RELEASE);
+    return index;
+}
+
+struct pshm_node *
+pshm_get_node(struct pshm_context* shm, uint32_t index) {
+    return &pshm_nodes(shm->hdr)[index];
+}
+
+void
+pshm_set_now(struct pshm_context* shm, uint64_t now) {
+    __atomic_store_n(&shm->hdr->now, now, __ATOMIC_RELAXED);
+}
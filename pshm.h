@@ -0,0 +1,93 @@
+#ifndef _PSHM_H_
+#define _PSHM_H_
+
+#include <unistd.h>
+#include <stdint.h>
+#include <string.h>
+
+// shared memory layout: header | nodes[node_cap] | strings[string_cap]
+// nodes and strings are append-only and published by node_count,
+// the counters of every node are guarded by the seqlock in its own seq
+
+#define PSHM_MAGIC      0x4d48534c      // "LSHM"
+#define PSHM_VERSION    2
+#define PSHM_NONE       0xffffffff
+
+struct pshm_header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t pid;
+    uint32_t reserved;
+    uint32_t node_cap;
+    uint32_t node_count;
+    uint32_t string_cap;
+    uint32_t string_size;
+    uint64_t ticks_per_sec;
+    uint64_t start;
+    uint64_t now;
+};
+
+struct pshm_node {
+    uint32_t parent;
+    uint32_t name;          // offset into the string area
+    uint32_t source;
+    int32_t  line;
+    uint32_t seq;           // odd while the writer is updating the counters
+    uint32_t reserved;
+    uint64_t count;
+    uint64_t record_time;
+    uint64_t alloc_count;
+};
+
+static inline size_t
+pshm_size(uint32_t node_cap, uint32_t string_cap) {
+    return sizeof(struct pshm_header) + (size_t)node_cap * sizeof(struct pshm_node) + string_cap;
+}
+
+static inline struct pshm_node *
+pshm_nodes(struct pshm_header* hdr) {
+    return (struct pshm_node*)(hdr + 1);
+}
+
+static inline char *
+pshm_strings(struct pshm_header* hdr) {
+    return (char*)(pshm_nodes(hdr) + hdr->node_cap);
+}
+
+// writer side: update the counters of one node between write_begin and write_end
+static inline void
+pshm_write_begin(struct pshm_node* node) {
+    __atomic_store_n(&node->seq, node->seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static inline void
+pshm_write_end(struct pshm_node* node) {
+    __atomic_store_n(&node->seq, node->seq + 1, __ATOMIC_RELEASE);
+}
+
+// reader side: copy one node between read_begin and read_retry, retry when it returns true
+static inline uint32_t
+pshm_read_begin(struct pshm_node* node) {
+    return __atomic_load_n(&node->seq, __ATOMIC_ACQUIRE);
+}
+
+static inline int
+pshm_read_retry(struct pshm_node* node, uint32_t seq) {
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return (seq & 1) || __atomic_load_n(&node->seq, __ATOMIC_RELAXED) != seq;
+}
+
+struct pshm_context;
+
+// fail when the name is used by a live process, errno is set; the segment of a dead process is replaced
+struct pshm_context* pshm_create(const char* name, uint32_t node_cap, uint32_t string_cap, uint64_t ticks_per_sec, uint64_t start);
+void pshm_free(struct pshm_context* shm);
+
+// return PSHM_NONE when the node table or string area is full
+uint32_t pshm_add_node(struct pshm_context* shm, uint32_t parent, const char* name, const char* source, int line);
+struct pshm_node* pshm_get_node(struct pshm_context* shm, uint32_t index);
+
+void pshm_set_now(struct pshm_context* shm, uint64_t now);
+
+#endif
@@ -0,0 +1,235 @@
+// out-of-process reader of the profiler shared memory view
+// usage: pshm-reader [-n top] [-f] name
+//   default prints the top n nodes by self time, -f prints folded stacks for flamegraph.pl
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "pshm.h"
+
+#define MAX_NODE_RETRY      100
+#define SPIN_NODE_RETRY     16
+#define MAX_BACKOFF         1000        // microsecond
+#define MAX_FRAME_NAME      512
+
+struct snapshot {
+    struct pshm_header  hdr;
+    struct pshm_node*   nodes;
+    char*               strings;
+    uint64_t*           self_time;
+    uint32_t            torn;
+};
+
+// a node is only locked while the hook writes its counters, so a short spin
+// then a growing sleep is enough, a node still odd after that belongs to a dead writer
+static int
+copy_node(struct pshm_node* shared, struct pshm_node* node) {
+    int retry = 0;
+    for (retry = 0; retry < MAX_NODE_RETRY; retry++) {
+        uint32_t seq = pshm_read_begin(shared);
+        memcpy(node, shared, sizeof(*node));
+        if (!pshm_read_retry(shared, seq)) {
+            return 0;
+        }
+        if (retry >= SPIN_NODE_RETRY) {
+            int backoff = 1 << (retry - SPIN_NODE_RETRY);
+            usleep(backoff < MAX_BACKOFF ? backoff : MAX_BACKOFF);
+        }
+    }
+    return -1;
+}
+
+static void
+take_snapshot(struct pshm_header* shared, struct snapshot* snap) {
+    memcpy(&snap->hdr, shared, sizeof(snap->hdr));
+    // node_count is published after the node and its strings are written
+    snap->hdr.node_count = __atomic_load_n(&shared->node_count, __ATOMIC_ACQUIRE);
+    snap->hdr.string_size = __atomic_load_n(&shared->string_size, __ATOMIC_ACQUIRE);
+    snap->hdr.now = __atomic_load_n(&shared->now, __ATOMIC_RELAXED);
+    if (snap->hdr.node_count > snap->hdr.node_cap) {
+        snap->hdr.node_count = snap->hdr.node_cap;
+    }
+    if (snap->hdr.string_size > snap->hdr.string_cap) {
+        snap->hdr.string_size = snap->hdr.string_cap;
+    }
+
+    uint32_t n = snap->hdr.node_count;
+    snap->nodes = (struct pshm_node*)malloc(sizeof(struct pshm_node) * (n ? n : 1));
+    snap->strings = (char*)malloc(snap->hdr.string_size + 1);
+    memcpy(snap->strings, pshm_strings(shared), snap->hdr.string_size);
+    snap->strings[snap->hdr.string_size] = '\0';
+
+    snap->torn = 0;
+    uint32_t i = 0;
+    for (i = 0; i < n; i++) {
+        struct pshm_node* node = &snap->nodes[i];
+        if (copy_node(&pshm_nodes(shared)[i], node) != 0) {
+            snap->torn++;
+        }
+        if (node->name >= snap->hdr.string_size || node->source >= snap->hdr.string_size) {
+            node->name = snap->hdr.string_size;
+            node->source = snap->hdr.string_size;
+        }
+    }
+}
+
+static double
+to_usec(struct snapshot* snap, uint64_t t) {
+    return (double)t * 1000000 / snap->hdr.ticks_per_sec;
+}
+
+static void
+frame_name(struct snapshot* snap, struct pshm_node* node, char* buf, size_t sz) {
+    snprintf(buf, sz, "%s %s:%d", snap->strings + node->name, snap->strings + node->source, node->line);
+}
+
+// record_time is inclusive, self time drops the time of the children
+static void
+calc_self_time(struct snapshot* snap) {
+    uint32_t n = snap->hdr.node_count;
+    uint32_t i = 0;
+    int64_t* self = (int64_t*)calloc(n ? n : 1, sizeof(int64_t));
+    for (i = 0; i < n; i++) {
+        struct pshm_node* node = &snap->nodes[i];
+        self[i] += node->record_time;
+        if (node->parent != PSHM_NONE && node->parent < n) {
+            self[node->parent] -= node->record_time;
+        }
+    }
+    for (i = 0; i < n; i++) {
+        if (self[i] < 0) {
+            self[i] = 0;
+        }
+    }
+    snap->self_time = (uint64_t*)self;
+}
+
+static struct snapshot* g_sort_snap = NULL;
+static int
+_cmp_self_time(const void* a, const void* b) {
+    uint64_t ta = g_sort_snap->self_time[*(const uint32_t*)a];
+    uint64_t tb = g_sort_snap->self_time[*(const uint32_t*)b];
+    return ta < tb ? 1 : (ta > tb ? -1 : 0);
+}
+
+static void
+print_top(struct snapshot* snap, int top) {
+    uint32_t n = snap->hdr.node_count;
+    uint32_t* order = (uint32_t*)malloc(sizeof(uint32_t) * (n ? n : 1));
+    uint32_t i = 0;
+    for (i = 0; i < n; i++) {
+        order[i] = i;
+    }
+    g_sort_snap = snap;
+    qsort(order, n, sizeof(uint32_t), _cmp_self_time);
+
+    char name[MAX_FRAME_NAME];
+    printf("pid %u  elapsed %.3fs  nodes %u\n", snap->hdr.pid,
+        to_usec(snap, snap->hdr.now - snap->hdr.start) / 1000000, n);
+    printf("%14s %14s %12s %14s  %s\n", "self(us)", "total(us)", "count", "alloc", "name");
+    for (i = 0; i < n && (int)i < top; i++) {
+        struct pshm_node* node = &snap->nodes[order[i]];
+        frame_name(snap, node, name, sizeof(name));
+        printf("%14.0f %14.0f %12llu %14llu  %s\n",
+            to_usec(snap, snap->self_time[order[i]]), to_usec(snap, node->record_time),
+            (unsigned long long)node->count, (unsigned long long)node->alloc_count, name);
+    }
+    free(order);
+}
+
+static void
+print_folded(struct snapshot* snap) {
+    uint32_t n = snap->hdr.node_count;
+    uint32_t* stack = (uint32_t*)malloc(sizeof(uint32_t) * (n ? n : 1));
+    char name[MAX_FRAME_NAME];
+    uint32_t i = 0;
+    for (i = 0; i < n; i++) {
+        uint64_t usec = (uint64_t)to_usec(snap, snap->self_time[i]);
+        if (usec == 0 || snap->nodes[i].parent == PSHM_NONE) {
+            continue;
+        }
+        // skip the "total" root, it has no frame of its own
+        uint32_t depth = 0;
+        uint32_t idx = i;
+        while (idx != PSHM_NONE && idx < n && snap->nodes[idx].parent != PSHM_NONE && depth < n) {
+            stack[depth++] = idx;
+            idx = snap->nodes[idx].parent;
+        }
+        while (depth > 0) {
+            frame_name(snap, &snap->nodes[stack[--depth]], name, sizeof(name));
+            fputs(name, stdout);
+            fputc(depth > 0 ? ';' : ' ', stdout);
+        }
+        printf("%llu\n", (unsigned long long)usec);
+    }
+    free(stack);
+}
+
+static void
+usage(const char* prog) {
+    fprintf(stderr, "usage: %s [-n top] [-f] name\n", prog);
+    exit(1);
+}
+
+int
+main(int argc, char* argv[]) {
+    int top = 30;
+    int folded = 0;
+    const char* name = NULL;
+    int i = 0;
+    for (i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-n") == 0 && i + 1 < argc) {
+            top = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-f") == 0) {
+            folded = 1;
+        } else if (argv[i][0] != '-' && !name) {
+            name = argv[i];
+        } else {
+            usage(argv[0]);
+        }
+    }
+    if (!name) {
+        usage(argv[0]);
+    }
+
+    char path[256];
+    snprintf(path, sizeof(path), "%s%s", name[0] == '/' ? "" : "/", name);
+    int fd = shm_open(path, O_RDONLY, 0);
+    if (fd < 0) {
+        perror(path);
+        return 1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(struct pshm_header)) {
+        fprintf(stderr, "%s: invalid shared memory\n", path);
+        return 1;
+    }
+    struct pshm_header* shared = (struct pshm_header*)mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (shared == MAP_FAILED) {
+        perror("mmap");
+        return 1;
+    }
+    if (__atomic_load_n(&shared->magic, __ATOMIC_ACQUIRE) != PSHM_MAGIC || shared->version != PSHM_VERSION
+        || pshm_size(shared->node_cap, shared->string_cap) > (size_t)st.st_size) {
+        fprintf(stderr, "%s: not a profile shared memory\n", path);
+        return 1;
+    }
+
+    struct snapshot snap;
+    take_snapshot(shared, &snap);
+    if (snap.torn > 0) {
+        fprintf(stderr, "%s: %u nodes stayed locked by the writer, their counters may be torn\n", path, snap.torn);
+    }
+    calc_self_time(&snap);
+
+    if (folded) {
+        print_folded(&snap);
+    } else {
+        print_top(&snap, top);
+    }
+    return 0;
+}
@@ -0,0 +1,38 @@
+#ifndef _PSNAP_H_
+#define _PSNAP_H_
+
+#include <stdint.h>
+
+// binary profile snapshot written by c.save
+// layout: header | symbols[symbol_count] | nodes[node_count] | strings[string_size]
+// nodes are stored parent first, node 0 is the "total" root
+
+#define PSNAP_MAGIC     0x4e53504c      // "LPSN"
+#define PSNAP_VERSION   1
+#define PSNAP_NONE      0xffffffff
+
+struct psnap_header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t node_count;
+    uint32_t symbol_count;
+    uint32_t string_size;
+    uint32_t reserved;
+    uint64_t record_time;   // microsecond
+};
+
+struct psnap_symbol {
+    uint32_t name;          // offset into the string area
+    uint32_t source;
+    int32_t  line;
+};
+
+struct psnap_node {
+    uint32_t parent;
+    uint32_t symbol;
+    uint64_t count;
+    uint64_t value;         // microsecond
+    uint64_t alloc_count;
+};
+
+#endif
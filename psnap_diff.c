@@ -0,0 +1,345 @@
+// offline diff of two profile snapshots written by c.save
+// usage: psnap-diff [-n top] [-s self|time|count|alloc] old.snap new.snap
+//   call paths are aligned by their (name, source, line) chain from the root,
+//   output is sorted by the regression of the chosen metric, biggest first;
+//   self is the time of a path without its children, time includes them
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "psnap.h"
+
+enum sort_key {
+    SK_SELF,
+    SK_TIME,
+    SK_COUNT,
+    SK_ALLOC,
+};
+
+struct snapshot {
+    struct psnap_header     hdr;
+    struct psnap_symbol*    symbols;
+    struct psnap_node*      nodes;
+    char*                   strings;
+    uint64_t*               path_hash;
+    char*                   buffer;
+};
+
+struct delta {
+    const struct snapshot*  snap;       // the snapshot the path is printed from
+    uint32_t    index;
+    int64_t     self;
+    int64_t     time;
+    int64_t     count;
+    int64_t     alloc;
+    uint64_t    old_time;
+    uint64_t    new_time;
+};
+
+static uint64_t
+hash_bytes(uint64_t h, const char* s, size_t len) {
+    size_t i = 0;
+    for (i = 0; i < len; i++) {
+        h ^= (unsigned char)s[i];
+        h *= 0x100000001b3ULL;
+    }
+    return h;
+}
+
+static uint64_t
+hash_mix(uint64_t a, uint64_t b) {
+    uint64_t h = (a ^ (b + 0x9E3779B97F4A7C15ULL + (a << 6) + (a >> 2))) * 0xff51afd7ed558ccdULL;
+    return h ^ (h >> 33);
+}
+
+static const char*
+snap_string(const struct snapshot* snap, uint32_t offset) {
+    return offset < snap->hdr.string_size ? snap->strings + offset : "";
+}
+
+static int
+load_snapshot(const char* filename, struct snapshot* snap) {
+    FILE* f = fopen(filename, "rb");
+    if (!f) {
+        perror(filename);
+        return -1;
+    }
+    if (fread(&snap->hdr, sizeof(snap->hdr), 1, f) != 1
+        || snap->hdr.magic != PSNAP_MAGIC || snap->hdr.version != PSNAP_VERSION) {
+        fprintf(stderr, "%s: not a profile snapshot\n", filename);
+        fclose(f);
+        return -1;
+    }
+
+    size_t symbol_size = sizeof(struct psnap_symbol) * snap->hdr.symbol_count;
+    size_t node_size = sizeof(struct psnap_node) * snap->hdr.node_count;
+    size_t size = symbol_size + node_size + snap->hdr.string_size + 1;
+    snap->buffer = (char*)malloc(size);
+    if (fread(snap->buffer, 1, size - 1, f) != size - 1) {
+        fprintf(stderr, "%s: truncated snapshot\n", filename);
+        fclose(f);
+        return -1;
+    }
+    fclose(f);
+    snap->buffer[size - 1] = '\0';
+    snap->symbols = (struct psnap_symbol*)snap->buffer;
+    snap->nodes = (struct psnap_node*)(snap->buffer + symbol_size);
+    snap->strings = snap->buffer + symbol_size + node_size;
+
+    // hash of every symbol, then of every path: parents are stored before their children
+    uint32_t i = 0;
+    uint64_t* symbol_hash = (uint64_t*)malloc(sizeof(uint64_t) * (snap->hdr.symbol_count + 1));
+    for (i = 0; i < snap->hdr.symbol_count; i++) {
+        struct psnap_symbol* sym = &snap->symbols[i];
+        const char* name = snap_string(snap, sym->name);
+        const char* source = snap_string(snap, sym->source);
+        uint64_t h = 0xcbf29ce484222325ULL;
+        h = hash_bytes(h, name, strlen(name) + 1);
+        h = hash_bytes(h, source, strlen(source) + 1);
+        h = hash_bytes(h, (const char*)&sym->line, sizeof(sym->line));
+        symbol_hash[i] = h;
+    }
+    snap->path_hash = (uint64_t*)malloc(sizeof(uint64_t) * (snap->hdr.node_count + 1));
+    for (i = 0; i < snap->hdr.node_count; i++) {
+        struct psnap_node* node = &snap->nodes[i];
+        if (node->symbol >= snap->hdr.symbol_count
+            || (node->parent != PSNAP_NONE && node->parent >= i)) {
+            fprintf(stderr, "%s: corrupted node %u\n", filename, i);
+            free(symbol_hash);
+            return -1;
+        }
+        uint64_t parent = node->parent == PSNAP_NONE ? 0 : snap->path_hash[node->parent];
+        snap->path_hash[i] = hash_mix(parent, symbol_hash[node->symbol]);
+    }
+    free(symbol_hash);
+    return 0;
+}
+
+// the call paths of one snapshot merged by path hash: C functions called from the
+// same lua line share (name, source, line), their sibling nodes are one path here
+struct path_entry {
+    uint64_t    hash;
+    uint32_t    index;          // first node of the path, used to print it
+    uint64_t    count;
+    uint64_t    value;          // inclusive
+    int64_t     self;           // value minus the value of the child paths
+    uint64_t    alloc_count;
+};
+
+// open addressing path_hash -> entry index
+struct path_map {
+    struct path_entry*  entries;
+    uint32_t    size;
+    uint32_t*   slots;
+    size_t      mask;
+};
+
+static void
+path_map_build(struct path_map* m, const struct snapshot* snap) {
+    size_t size = 16;
+    while (size < (size_t)snap->hdr.node_count * 2) {
+        size *= 2;
+    }
+    m->mask = size - 1;
+    m->slots = (uint32_t*)malloc(sizeof(uint32_t) * size);
+    memset(m->slots, 0xff, sizeof(uint32_t) * size);
+    m->entries = (struct path_entry*)malloc(sizeof(struct path_entry) * ((size_t)snap->hdr.node_count + 1));
+    m->size = 0;
+    uint32_t* node_entry = (uint32_t*)malloc(sizeof(uint32_t) * ((size_t)snap->hdr.node_count + 1));
+
+    uint32_t i = 0;
+    for (i = 0; i < snap->hdr.node_count; i++) {
+        const struct psnap_node* node = &snap->nodes[i];
+        uint64_t key = snap->path_hash[i];
+        size_t slot = key & m->mask;
+        while (m->slots[slot] != PSNAP_NONE && m->entries[m->slots[slot]].hash != key) {
+            slot = (slot + 1) & m->mask;
+        }
+        if (m->slots[slot] == PSNAP_NONE) {
+            struct path_entry* e = &m->entries[m->size];
+            e->hash = key;
+            e->index = i;
+            e->count = 0;
+            e->value = 0;
+            e->self = 0;
+            e->alloc_count = 0;
+            m->slots[slot] = m->size++;
+        }
+        node_entry[i] = m->slots[slot];
+        struct path_entry* e = &m->entries[m->slots[slot]];
+        e->count += node->count;
+        e->value += node->value;
+        e->self += node->value;
+        e->alloc_count += node->alloc_count;
+        // parents come first, their entry is known
+        if (node->parent != PSNAP_NONE) {
+            m->entries[node_entry[node->parent]].self -= node->value;
+        }
+    }
+    for (i = 0; i < m->size; i++) {
+        if (m->entries[i].self < 0) {
+            m->entries[i].self = 0;
+        }
+    }
+    free(node_entry);
+}
+
+static uint32_t
+path_map_query(const struct path_map* m, uint64_t key) {
+    size_t slot = key & m->mask;
+    while (m->slots[slot] != PSNAP_NONE) {
+        if (m->entries[m->slots[slot]].hash == key) {
+            return m->slots[slot];
+        }
+        slot = (slot + 1) & m->mask;
+    }
+    return PSNAP_NONE;
+}
+
+static enum sort_key g_sort_key = SK_SELF;
+
+static int64_t
+delta_key(const struct delta* d) {
+    switch (g_sort_key) {
+    case SK_SELF:   return d->self;
+    case SK_TIME:   return d->time;
+    case SK_COUNT:  return d->count;
+    default:        return d->alloc;
+    }
+}
+
+static int
+_cmp_delta(const void* a, const void* b) {
+    int64_t va = delta_key((const struct delta*)a);
+    int64_t vb = delta_key((const struct delta*)b);
+    return va < vb ? 1 : (va > vb ? -1 : 0);
+}
+
+static void
+print_path(const struct snapshot* snap, uint32_t index) {
+    uint32_t stack[1024];
+    uint32_t depth = 0;
+    // skip the "total" root
+    while (index != PSNAP_NONE && snap->nodes[index].parent != PSNAP_NONE && depth < 1024) {
+        stack[depth++] = index;
+        index = snap->nodes[index].parent;
+    }
+    if (depth == 0) {
+        fputs("total", stdout);
+    }
+    while (depth > 0) {
+        const struct psnap_symbol* sym = &snap->symbols[snap->nodes[stack[--depth]].symbol];
+        printf("%s %s:%d%s", snap_string(snap, sym->name), snap_string(snap, sym->source), sym->line,
+            depth > 0 ? ";" : "");
+    }
+}
+
+static void
+usage(const char* prog) {
+    fprintf(stderr, "usage: %s [-n top] [-s self|time|count|alloc] old.snap new.snap\n", prog);
+    exit(1);
+}
+
+int
+main(int argc, char* argv[]) {
+    int top = 50;
+    const char* files[2] = {NULL, NULL};
+    int nfile = 0;
+    int i = 0;
+    for (i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-n") == 0 && i + 1 < argc) {
+            top = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-s") == 0 && i + 1 < argc) {
+            const char* key = argv[++i];
+            if (strcmp(key, "self") == 0) {
+                g_sort_key = SK_SELF;
+            } else if (strcmp(key, "time") == 0) {
+                g_sort_key = SK_TIME;
+            } else if (strcmp(key, "count") == 0) {
+                g_sort_key = SK_COUNT;
+            } else if (strcmp(key, "alloc") == 0) {
+                g_sort_key = SK_ALLOC;
+            } else {
+                usage(argv[0]);
+            }
+        } else if (argv[i][0] != '-' && nfile < 2) {
+            files[nfile++] = argv[i];
+        } else {
+            usage(argv[0]);
+        }
+    }
+    if (nfile != 2) {
+        usage(argv[0]);
+    }
+
+    struct snapshot old_snap, new_snap;
+    if (load_snapshot(files[0], &old_snap) != 0 || load_snapshot(files[1], &new_snap) != 0) {
+        return 1;
+    }
+
+    struct path_map old_map, new_map;
+    path_map_build(&old_map, &old_snap);
+    path_map_build(&new_map, &new_snap);
+    uint32_t old_count = old_map.size;
+    uint32_t new_count = new_map.size;
+    char* matched = (char*)calloc(old_count + 1, 1);
+    struct delta* deltas = (struct delta*)malloc(sizeof(struct delta) * ((size_t)old_count + new_count + 1));
+    size_t n = 0;
+
+    uint32_t k = 0;
+    for (k = 0; k < new_count; k++) {
+        const struct path_entry* ne = &new_map.entries[k];
+        uint32_t o = path_map_query(&old_map, ne->hash);
+        struct delta* d = &deltas[n++];
+        d->snap = &new_snap;
+        d->index = ne->index;
+        d->new_time = ne->value;
+        if (o != PSNAP_NONE) {
+            const struct path_entry* oe = &old_map.entries[o];
+            matched[o] = 1;
+            d->old_time = oe->value;
+            d->self = ne->self - oe->self;
+            d->time = (int64_t)ne->value - (int64_t)oe->value;
+            d->count = (int64_t)ne->count - (int64_t)oe->count;
+            d->alloc = (int64_t)ne->alloc_count - (int64_t)oe->alloc_count;
+        } else {
+            d->old_time = 0;
+            d->self = ne->self;
+            d->time = (int64_t)ne->value;
+            d->count = (int64_t)ne->count;
+            d->alloc = (int64_t)ne->alloc_count;
+        }
+    }
+    for (k = 0; k < old_count; k++) {
+        if (matched[k]) {
+            continue;
+        }
+        const struct path_entry* oe = &old_map.entries[k];
+        struct delta* d = &deltas[n++];
+        d->snap = &old_snap;
+        d->index = oe->index;
+        d->old_time = oe->value;
+        d->new_time = 0;
+        d->self = -oe->self;
+        d->time = -(int64_t)oe->value;
+        d->count = -(int64_t)oe->count;
+        d->alloc = -(int64_t)oe->alloc_count;
+    }
+
+    qsort(deltas, n, sizeof(struct delta), _cmp_delta);
+
+    printf("old %s: %u nodes %u paths %.3fs\nnew %s: %u nodes %u paths %.3fs\n",
+        files[0], old_snap.hdr.node_count, old_count, (double)old_snap.hdr.record_time / 1000000,
+        files[1], new_snap.hdr.node_count, new_count, (double)new_snap.hdr.record_time / 1000000);
+    printf("%14s %14s %12s %14s %14s %14s  %s\n", "dself(us)", "dtime(us)", "dcount", "dalloc", "old(us)", "new(us)", "path");
+    size_t j = 0;
+    for (j = 0; j < n && (int)j < top; j++) {
+        struct delta* d = &deltas[j];
+        printf("%+14lld %+14lld %+12lld %+14lld %14llu %14llu  ",
+            (long long)d->self, (long long)d->time, (long long)d->count, (long long)d->alloc,
+            (unsigned long long)d->old_time, (unsigned long long)d->new_time);
+        print_path(d->snap, d->index);
+        fputc('\n', stdout);
+    }
+    return 0;
+}